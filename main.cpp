@@ -1,38 +1,354 @@
-
 #include "randodo.h"
+#include "randodo_daemon.h"
 
-int main(int argc, char **argv)
+#include <csignal>
+#include <cstdio>
+#include <filesystem>
+
+// The state of this one can be saved, which checkpoints rely on.
+typedef Randodo::EntropyPoolingRandomNumberGenerator<Randodo::SeededRandomNumberGenerator> CliRandomNumberGenerator;
+
+typedef Randodo::ConfigFile<Randodo::PlainFileReader, CliRandomNumberGenerator> CliConfigFile;
+
+static Randodo::Daemon::Server<> *runningServer = nullptr;
+
+static void stopServer(int)
 {
-    if (argc < 3) {
-        std::cerr << "Usage: randodo <file_name> <generator_name> [how_many=1]" << std::endl;
-        return -1;
+    runningServer->stop();
+}
+
+static int serve(const std::string &fileName, const std::string &socketPath)
+{
+    Randodo::Daemon::Server<> server(fileName, socketPath);
+
+    std::string errMsg;
+    if (!server.start(errMsg)) {
+        std::cerr << errMsg << std::endl;
+        return -2;
     }
 
-    srand(time(NULL));
+    runningServer = &server;
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
 
-    std::string fileName = argv[1], generatorName = argv[2];
+    server.run();
+    return 0;
+}
 
-    int howMany = 1;
-    if (argc > 3) {
-        howMany = atoi(argv[3]);
+static int printMemoryStats(const std::string &fileName)
+{
+    CliConfigFile plain(fileName, false), optimized(fileName);
+    if (!plain.isValid()) {
+        std::cerr << plain.getErrMsg() << std::endl;
+        return -2;
+    }
+    auto &plainGenerators = plain.getMapOfGenerators();
+    auto &optimizedGenerators = optimized.getMapOfGenerators();
+    if (plainGenerators.empty()) {
+        std::cerr << "Couldn't find specified file or generator" << std::endl;
+        return -2;
     }
 
-    Randodo::ConfigFile<> configFile(fileName);
+    size_t plainTotal = 0, optimizedTotal = 0;
+    printf("%-24s %14s %14s\n", "generator", "plain bytes", "optimized bytes");
+    for (auto &entry : plainGenerators) {
+        size_t plainBytes = entry.second->memoryFootprint();
+        size_t optimizedBytes = optimizedGenerators.find(entry.first)->second->memoryFootprint();
+        plainTotal += plainBytes;
+        optimizedTotal += optimizedBytes;
+        printf("%-24s %14zu %14zu\n", entry.first.c_str(), plainBytes, optimizedBytes);
+    }
+    printf("%-24s %14zu %14zu\n", "total", plainTotal, optimizedTotal);
+    return 0;
+}
 
-    auto &mapOfGenerators = configFile.getMapOfGenerators();
-    auto iter = mapOfGenerators.find(generatorName);
+// Everything needed to carry on with an interrupted run.
+struct Job
+{
+    std::string fileName; // absolute when checkpointing
+    long long specSize = 0; // the specification as it was when the run started
+    uint64_t specHash = 0;
+    std::string generatorName; // in the plain mode
+    std::string columns; // in the record mode
+    Randodo::RecordFormat format = Randodo::CSV;
+    bool bindVariables = false;
+    long long howMany = 1;
+    long long nextIndex = 0;
+    long long outputBytes = 0;
+    std::string checkpointFile;
+    long long checkpointEvery = 0;
+};
 
-    if (iter == mapOfGenerators.end()) {
-        std::cerr << "Couldn't find specified file or generator" << std::endl;
+static const char CHECKPOINT_MAGIC[] = "randodo-checkpoint-2";
+
+static const long long BATCH_SIZE = 256;
+
+static bool parseRecordFormat(const std::string &name, Randodo::RecordFormat &format)
+{
+    if (name == "csv") {
+        format = Randodo::CSV;
+    } else if (name == "tsv") {
+        format = Randodo::TSV;
+    } else if (name == "jsonl") {
+        format = Randodo::JSON_LINES;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// FNV-1a of the file's contents, so a resumed run can tell the spec changed.
+static bool hashFile(const std::string &fileName, long long &size, uint64_t &hash)
+{
+    std::ifstream file(fileName, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    size = 0;
+    hash = 14695981039346656037ULL;
+    char buffer[64 * 1024];
+    while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
+        for (std::streamsize i = 0; i < file.gcount(); i++) {
+            hash = (hash ^ static_cast<unsigned char>(buffer[i])) * 1099511628211ULL;
+        }
+        size += file.gcount();
+    }
+    return true;
+}
+
+// Written aside and renamed, so a crash never leaves a half-written checkpoint.
+static bool writeCheckpoint(const Job &job)
+{
+    std::string tmpName = job.checkpointFile + ".tmp";
+    {
+        std::ofstream file(tmpName);
+        file << CHECKPOINT_MAGIC << '\n'
+             << job.fileName << '\n'
+             << job.specSize << ' ' << job.specHash << '\n'
+             << job.generatorName << '\n'
+             << job.columns << '\n'
+             << job.format << ' ' << job.bindVariables << ' ' << job.howMany << ' '
+             << job.nextIndex << ' ' << job.outputBytes << ' ' << job.checkpointEvery << '\n';
+        CliRandomNumberGenerator::saveState(file);
+        file << '\n';
+        if (!file.good()) {
+            return false;
+        }
+    }
+    return rename(tmpName.c_str(), job.checkpointFile.c_str()) == 0;
+}
+
+static bool readCheckpoint(const std::string &checkpointFile, Job &job)
+{
+    std::ifstream file(checkpointFile);
+    std::string magic;
+    int format;
+    if (!std::getline(file, magic) || magic != CHECKPOINT_MAGIC
+            || !std::getline(file, job.fileName)
+            || !(file >> job.specSize >> job.specHash)
+            || !file.ignore() // the rest of the line
+            || !std::getline(file, job.generatorName)
+            || !std::getline(file, job.columns)
+            || !(file >> format >> job.bindVariables >> job.howMany
+                      >> job.nextIndex >> job.outputBytes >> job.checkpointEvery)
+            || !CliRandomNumberGenerator::loadState(file)) {
+        return false;
+    }
+    job.format = static_cast<Randodo::RecordFormat>(format);
+    job.checkpointFile = checkpointFile;
+    return true;
+}
+
+static int run(Job &job)
+{
+    CliConfigFile configFile(job.fileName);
+    if (!configFile.isValid()) {
+        std::cerr << configFile.getErrMsg() << std::endl;
         return -2;
     }
+    auto &mapOfGenerators = configFile.getMapOfGenerators();
+
+    Randodo::Generator *generator = nullptr;
+    Randodo::RecordGenerator recordGenerator(mapOfGenerators, job.format, job.bindVariables);
+    if (job.columns.empty()) {
+        auto iter = mapOfGenerators.find(job.generatorName);
+        if (iter == mapOfGenerators.end()) {
+            std::cerr << "Couldn't find specified file or generator" << std::endl;
+            return -2;
+        }
+        generator = iter->second.get();
+    } else {
+        std::stringstream columnsStream(job.columns);
+        std::string column;
+        while (std::getline(columnsStream, column, ',')) {
+            if (!recordGenerator.addColumn(column)) {
+                std::cerr << "Couldn't find specified file or generator " << column << std::endl;
+                return -2;
+            }
+        }
+    }
+
+    std::string buffer;
+    auto flush = [&]() {
+        std::cout.write(buffer.data(), buffer.size());
+        job.outputBytes += buffer.size();
+        buffer.clear();
+    };
+
+    if (!generator && job.nextIndex == 0) {
+        recordGenerator.generateHeader(buffer);
+    }
 
-    for (int i = 0; i < howMany; ++i) {
-        std::stringstream stream;
-        iter->second->generate(stream);
-        std::cout << stream.str() << std::endl;
+    if (job.checkpointEvery > 0 && job.nextIndex == 0 && !writeCheckpoint(job)) {
+        std::cerr << "Couldn't write checkpoint" << std::endl;
+        return -3;
     }
 
+    std::vector<std::string> batch;
+    while (job.nextIndex < job.howMany) {
+        long long end = job.howMany;
+        if (job.checkpointEvery > 0) {
+            end = std::min(end, (job.nextIndex / job.checkpointEvery + 1) * job.checkpointEvery);
+        }
+
+        for (long long done = job.nextIndex; done < end; ) {
+            if (generator) {
+                // Batches start at multiples of BATCH_SIZE, checkpoints too, so
+                // random numbers get drawn in the same order in every run.
+                batch.resize(std::min((done / BATCH_SIZE + 1) * BATCH_SIZE, end) - done);
+                for (auto &value : batch) {
+                    value.clear();
+                }
+                generator->generateBatch(batch);
+                for (auto &value : batch) {
+                    buffer += value;
+                    buffer += '\n';
+                }
+                done += batch.size();
+            } else {
+                recordGenerator.generate(buffer);
+                done++;
+            }
+            if (buffer.size() >= 64 * 1024) {
+                flush();
+            }
+        }
+        job.nextIndex = end;
+
+        if (job.checkpointEvery > 0 && job.nextIndex < job.howMany) {
+            // The checkpoint may only mention output which really got out.
+            flush();
+            std::cout.flush();
+            if (!std::cout.good() || !writeCheckpoint(job)) {
+                std::cerr << "Couldn't write checkpoint" << std::endl;
+                return -3;
+            }
+        }
+    }
+    flush();
+    std::cout.flush();
+
+    if (!job.checkpointFile.empty()) {
+        remove(job.checkpointFile.c_str());
+    }
     return 0;
 }
 
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        std::cerr << "Usage: randodo <file_name> <generator_name> [options] [how_many=1]" << std::endl
+                  << "       randodo <file_name> --record <generator>[,<generator>...]"
+                     " [--format csv|tsv|jsonl] [--bind] [options] [how_many=1]" << std::endl
+                  << "       randodo --resume <checkpoint_file>" << std::endl
+                  << "       randodo <file_name> --serve <socket_path>" << std::endl
+                  << "       randodo <file_name> --mem-stats" << std::endl
+                  << "Options: --seed <number>, --checkpoint <file>, --checkpoint-every <how_many>" << std::endl;
+        return -1;
+    }
+
+    Job job;
+
+    if (std::string(argv[1]) == "--resume") {
+        if (!readCheckpoint(argv[2], job)) {
+            std::cerr << "Couldn't read checkpoint " << argv[2] << std::endl;
+            return -2;
+        }
+        long long specSize;
+        uint64_t specHash;
+        if (!hashFile(job.fileName, specSize, specHash)
+                || specSize != job.specSize || specHash != job.specHash) {
+            // Strings generated from another spec wouldn't match the output so far.
+            std::cerr << "Specification file " << job.fileName
+                      << " is missing or changed since the checkpoint, can't resume" << std::endl;
+            return -2;
+        }
+        // Output up to the checkpoint is expected to be kept; anything
+        // written after it gets generated again.
+        std::cerr << "Resuming after " << job.nextIndex << " strings, "
+                  << job.outputBytes << " bytes of output" << std::endl;
+        return run(job);
+    }
+
+    job.fileName = argv[1];
+
+    if (std::string(argv[2]) == "--serve") {
+        if (argc < 4) {
+            std::cerr << "Missing socket path" << std::endl;
+            return -1;
+        }
+        return serve(job.fileName, argv[3]);
+    }
+
+    if (std::string(argv[2]) == "--mem-stats") {
+        return printMemoryStats(job.fileName);
+    }
+
+    uint64_t seed = time(NULL);
+
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--record" && hasValue) {
+            job.columns = argv[++i];
+        } else if (arg == "--format" && hasValue) {
+            if (!parseRecordFormat(argv[++i], job.format)) {
+                std::cerr << "Unknown format, use csv, tsv or jsonl" << std::endl;
+                return -1;
+            }
+        } else if (arg == "--bind") {
+            job.bindVariables = true;
+        } else if (arg == "--seed" && hasValue) {
+            seed = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--checkpoint" && hasValue) {
+            job.checkpointFile = argv[++i];
+        } else if (arg == "--checkpoint-every" && hasValue) {
+            job.checkpointEvery = atoll(argv[++i]);
+        } else if (i == 2) {
+            job.generatorName = arg;
+        } else {
+            job.howMany = atoll(argv[i]);
+        }
+    }
+
+    if (job.checkpointFile.empty() != (job.checkpointEvery <= 0)) {
+        std::cerr << "--checkpoint and --checkpoint-every go together" << std::endl;
+        return -1;
+    }
+
+    if (job.columns.empty()) {
+        job.checkpointEvery = (job.checkpointEvery + BATCH_SIZE - 1) / BATCH_SIZE * BATCH_SIZE;
+    }
+
+    if (!job.checkpointFile.empty()) {
+        // Resuming may happen from another directory.
+        job.fileName = std::filesystem::absolute(job.fileName).string();
+        if (!hashFile(job.fileName, job.specSize, job.specHash)) {
+            std::cerr << "Couldn't find specified file or generator" << std::endl;
+            return -2;
+        }
+    }
+
+    CliRandomNumberGenerator::seed(seed);
+    return run(job);
+}
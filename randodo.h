@@ -1,14 +1,28 @@
 /* License: GPL v2 */
 /* Contact author: wrochniak@gmail.com */
 
+#ifndef RANDODO_H
+#define RANDODO_H
+
 #include <string>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <map>
+#include <vector>
 #include <memory>
 #include <stack>
 #include <algorithm>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <string_view>
+#include <cstdint>
+#include <random>
+#include <iterator>
+#include <cstddef>
+#include <cstring>
 #include <cassert>
 
 namespace Randodo
@@ -35,15 +49,72 @@ public:
 class Generator
 {
 public:
-    virtual void generate(std::stringstream &output) = 0;
+    // Appends a generated string to output, so callers can reuse one buffer.
+    virtual void generate(std::string &output) = 0;
+
+    void generate(std::stringstream &output)
+    {
+        std::string buffer;
+        generate(buffer);
+        output << buffer;
+    }
+
+    // Appends a generated string to each of the count outputs. Nodes process
+    // the whole batch in one visit, which amortizes the cost of dispatching
+    // through the tree; the order of random draws differs from calling
+    // generate() count times, the distribution of strings doesn't.
+    virtual void generateBatch(std::string *const *outputs, size_t count)
+    {
+        for (size_t i = 0; i < count; i++) {
+            generate(*outputs[i]);
+        }
+    }
+
+    void generateBatch(std::vector<std::string> &outputs)
+    {
+        std::vector<std::string *> pointers(outputs.size());
+        for (size_t i = 0; i < outputs.size(); i++) {
+            pointers[i] = &outputs[i];
+        }
+        generateBatch(pointers.data(), pointers.size());
+    }
 
     virtual bool isEmpty() = 0;
 
     virtual void optimize() = 0;
 
+    // If the generator always gives the same string, of at most maxSize
+    // bytes, appends it to value. Longer ones are never built.
+    virtual bool tellIfConstant(std::string &, size_t)
+    {
+        return false;
+    }
+
+    // Approximate number of bytes taken by the generator and its children,
+    // not counting allocator overhead. Only the base object by default, so
+    // generators owning more memory should override it.
+    virtual size_t memoryFootprint()
+    {
+        return sizeof(*this);
+    }
+
     virtual ~Generator() {}
 };
 
+inline size_t heapBytes(const std::string &value)
+{
+    // Short strings live inside the std::string object itself.
+    const char *data = value.data();
+    const char *object = reinterpret_cast<const char *>(&value);
+    return (data >= object && data < object + sizeof(value)) ? 0 : value.capacity() + 1;
+}
+
+template<typename T>
+size_t heapBytes(const std::vector<T> &values)
+{
+    return values.capacity() * sizeof(T);
+}
+
 typedef std::map<std::string, std::unique_ptr<Generator>> MapOfGenerators;
 
 class ConstGenerator : public Generator
@@ -51,12 +122,22 @@ class ConstGenerator : public Generator
 private:
     std::string _value;
 public:
+    using Generator::generate;
+    using Generator::generateBatch;
+
     ConstGenerator(const std::string &value)
         : _value(value) {}
 
-    void generate(std::stringstream &output)
+    void generate(std::string &output)
     {
-        output << _value;
+        output += _value;
+    }
+
+    void generateBatch(std::string *const *outputs, size_t count)
+    {
+        for (size_t i = 0; i < count; i++) {
+            outputs[i]->append(_value);
+        }
     }
 
     bool isEmpty()
@@ -65,28 +146,227 @@ public:
     }
 
     void optimize() {}
+
+    bool tellIfConstant(std::string &value, size_t maxSize)
+    {
+        if (_value.size() > maxSize) {
+            return false;
+        }
+        value += _value;
+        return true;
+    }
+
+    size_t memoryFootprint()
+    {
+        return sizeof(*this) + heapBytes(_value);
+    }
+};
+
+template<typename RandNumGenerator>
+auto randomBelow(RandNumGenerator &randNumGenerator, uint32_t bound, int)
+    -> decltype(randNumGenerator.getBounded(bound))
+{
+    return randNumGenerator.getBounded(bound);
+}
+
+template<typename RandNumGenerator>
+uint32_t randomBelow(RandNumGenerator &randNumGenerator, uint32_t bound, long)
+{
+    return randNumGenerator.get() % bound;
+}
+
+// Draws a number from [0, bound). Uses the policy's getBounded() if it has
+// one, and falls back to get() modulo bound otherwise.
+template<typename RandNumGenerator>
+uint32_t randomBelow(RandNumGenerator &randNumGenerator, uint32_t bound)
+{
+    return randomBelow(randNumGenerator, bound, 0);
+}
+
+inline void appendUtf8(uint32_t codePoint, std::string &output)
+{
+    if (codePoint < 0x80) {
+        output += static_cast<char>(codePoint);
+    } else if (codePoint < 0x800) {
+        char bytes[] = {static_cast<char>(0xc0 | (codePoint >> 6)),
+                        static_cast<char>(0x80 | (codePoint & 0x3f))};
+        output.append(bytes, 2);
+    } else if (codePoint < 0x10000) {
+        char bytes[] = {static_cast<char>(0xe0 | (codePoint >> 12)),
+                        static_cast<char>(0x80 | ((codePoint >> 6) & 0x3f)),
+                        static_cast<char>(0x80 | (codePoint & 0x3f))};
+        output.append(bytes, 3);
+    } else {
+        char bytes[] = {static_cast<char>(0xf0 | (codePoint >> 18)),
+                        static_cast<char>(0x80 | ((codePoint >> 12) & 0x3f)),
+                        static_cast<char>(0x80 | ((codePoint >> 6) & 0x3f)),
+                        static_cast<char>(0x80 | (codePoint & 0x3f))};
+        output.append(bytes, 4);
+    }
+}
+
+// UTF-16 surrogates, which aren't chars and have no UTF-8 encoding.
+inline bool isSurrogate(uint32_t codePoint)
+{
+    return codePoint >= 0xd800 && codePoint <= 0xdfff;
+}
+
+struct CharRange
+{
+    uint32_t first, last; // code points, both inclusive
 };
 
+/* Picks one code point out of a list of ranges, so [\u{4e00}-\u{9fff}] costs
+ * as much memory as [a-z]. Ranges keep the order they were written in. */
 template<typename RandNumGenerator>
 class CharAlternativeGenerator : public Generator
 {
 private:
-    std::string _possibleChars;
+    std::vector<CharRange> _ranges;
+    // _ends[i] is how many code points ranges 0..i hold together.
+    std::vector<uint32_t> _ends;
+    // Classes of ASCII chars only (at most 128 of them) are also kept
+    // spelled out, as indexing is faster than searching the ranges.
+    std::string _asciiChars;
     RandNumGenerator _randNumGenerator;
+
+    uint32_t pick()
+    {
+        uint32_t index = randomBelow(_randNumGenerator, _ends.back());
+        size_t range = std::upper_bound(_ends.begin(), _ends.end(), index) - _ends.begin();
+        return _ranges[range].last - (_ends[range] - 1 - index);
+    }
+
 public:
-    CharAlternativeGenerator(const std::string &possibleChars) : _possibleChars(possibleChars) {}
+    using Generator::generate;
+    using Generator::generateBatch;
 
-    void generate(std::stringstream &output)
+    CharAlternativeGenerator(std::vector<CharRange> &&ranges)
+    {
+        // Ranges spanning the surrogates are split around them.
+        for (CharRange range : ranges) {
+            if (range.first <= 0xdfff && range.last >= 0xd800) {
+                if (range.first < 0xd800) {
+                    _ranges.push_back(CharRange{range.first, 0xd7ff});
+                }
+                range.first = 0xe000;
+            }
+            if (range.first <= range.last) {
+                _ranges.push_back(range);
+            }
+        }
+
+        uint32_t total = 0;
+        bool ascii = true;
+        for (const CharRange &range : _ranges) {
+            total += range.last - range.first + 1;
+            _ends.push_back(total);
+            ascii = ascii && range.last < 0x80;
+        }
+
+        if (ascii) {
+            for (const CharRange &range : _ranges) {
+                for (uint32_t ch = range.first; ch <= range.last; ch++) {
+                    _asciiChars += static_cast<char>(ch);
+                }
+            }
+        }
+    }
+
+    void generate(std::string &output)
+    {
+        if (!_asciiChars.empty()) {
+            output += _asciiChars[randomBelow(_randNumGenerator, _asciiChars.size())];
+        } else {
+            appendUtf8(pick(), output);
+        }
+    }
+
+    void generateBatch(std::string *const *outputs, size_t count)
     {
-        output << _possibleChars[_randNumGenerator.get() % _possibleChars.size()];
+        if (!_asciiChars.empty()) {
+            const uint32_t size = _asciiChars.size();
+            for (size_t i = 0; i < count; i++) {
+                outputs[i]->push_back(_asciiChars[randomBelow(_randNumGenerator, size)]);
+            }
+            return;
+        }
+        for (size_t i = 0; i < count; i++) {
+            appendUtf8(pick(), *outputs[i]);
+        }
     }
 
     bool isEmpty()
     {
-        return _possibleChars.size() == 0;
+        return _ranges.empty();
     }
 
     void optimize() {}
+
+    size_t memoryFootprint()
+    {
+        return sizeof(*this) + heapBytes(_ranges) + heapBytes(_ends) + heapBytes(_asciiChars);
+    }
+};
+
+/* Values generated so far for the current record, by generator name. While
+ * bindings are active on a thread, every generator referenced in a record is
+ * evaluated once, and later references reuse that value. */
+class RowBindings
+{
+private:
+    // Kept between records so that the buffers get reused.
+    std::vector<std::pair<std::string, std::string>> _values;
+    size_t _used = 0;
+
+    static RowBindings *&currentSlot()
+    {
+        static thread_local RowBindings *current = nullptr;
+        return current;
+    }
+
+public:
+    static RowBindings *current()
+    {
+        return currentSlot();
+    }
+
+    void activate()
+    {
+        currentSlot() = this;
+    }
+
+    void deactivate()
+    {
+        currentSlot() = nullptr;
+    }
+
+    void clear()
+    {
+        _used = 0;
+    }
+
+    void generate(const std::string &name, Generator &generator, std::string &output)
+    {
+        for (size_t i = 0; i < _used; i++) {
+            if (_values[i].first == name) {
+                output += _values[i].second;
+                return;
+            }
+        }
+
+        // Generated aside, as nested references may bind values themselves.
+        std::string value;
+        generator.generate(value);
+
+        if (_used == _values.size()) {
+            _values.emplace_back();
+        }
+        _values[_used].first = name;
+        _values[_used].second = value;
+        _used++;
+        output += value;
+    }
 };
 
 class VariableGenerator : public Generator
@@ -95,14 +375,34 @@ private:
     std::string _varName;
     const MapOfGenerators &_mapOfGenerators;
 public:
+    using Generator::generate;
+    using Generator::generateBatch;
+
     VariableGenerator(std::string &&varName, const MapOfGenerators &mapOfGenerators)
         : _varName(std::move(varName)), _mapOfGenerators(mapOfGenerators) {}
 
-    void generate(std::stringstream &output)
+    void generate(std::string &output)
+    {
+        auto &&it = _mapOfGenerators.find(_varName);
+        if (it != _mapOfGenerators.end()) {
+            if (RowBindings *bindings = RowBindings::current()) {
+                bindings->generate(_varName, *it->second, output);
+            } else {
+                it->second->generate(output);
+            }
+        }
+    }
+
+    void generateBatch(std::string *const *outputs, size_t count)
     {
+        if (RowBindings::current()) {
+            // Bindings hold values of a single record, not of a batch.
+            Generator::generateBatch(outputs, count);
+            return;
+        }
         auto &&it = _mapOfGenerators.find(_varName);
         if (it != _mapOfGenerators.end()) {
-            it->second->generate(output);
+            it->second->generateBatch(outputs, count);
         }
     }
 
@@ -116,6 +416,12 @@ public:
     {
         // TODO: inline referenced generator
     }
+
+    size_t memoryFootprint()
+    {
+        // The referenced generator is accounted for under its own name.
+        return sizeof(*this) + heapBytes(_varName);
+    }
 };
 
 template<typename RandNumGenerator>
@@ -126,17 +432,55 @@ private:
     std::unique_ptr<Generator> _generator;
     RandNumGenerator _randNumGenerator;
 public:
+    using Generator::generate;
+    using Generator::generateBatch;
+
     RepetitionsGenerator(int from, int to, std::unique_ptr<Generator> &&generator)
         : _from(from), _to(to), _generator(std::move(generator)) {}
     
-    void generate(std::stringstream &output)
+    void generate(std::string &output)
     {
-        int howMany = _from + (_randNumGenerator.get() % (_to - _from + 1));
+        int howMany = _from + randomBelow(_randNumGenerator, _to - _from + 1);
         for (int i = 0; i < howMany; i++) {
             _generator->generate(output);
         }
     }
 
+    void generateBatch(std::string *const *outputs, size_t count)
+    {
+        if (_from == _to) {
+            for (int i = 0; i < _from; i++) {
+                _generator->generateBatch(outputs, count);
+            }
+            return;
+        }
+
+        // Each round visits only the outputs which still need more repetitions.
+        std::vector<std::string *> active(count);
+        std::vector<int> remaining(count);
+        size_t activeCount = 0;
+        for (size_t i = 0; i < count; i++) {
+            int howMany = _from + randomBelow(_randNumGenerator, _to - _from + 1);
+            if (howMany > 0) {
+                active[activeCount] = outputs[i];
+                remaining[activeCount++] = howMany;
+            }
+        }
+
+        while (activeCount > 0) {
+            _generator->generateBatch(active.data(), activeCount);
+
+            size_t stillActive = 0;
+            for (size_t i = 0; i < activeCount; i++) {
+                if (--remaining[i] > 0) {
+                    active[stillActive] = active[i];
+                    remaining[stillActive++] = remaining[i];
+                }
+            }
+            activeCount = stillActive;
+        }
+    }
+
     bool isEmpty()
     {
         return _from == 0 && _to == 0;
@@ -144,7 +488,24 @@ public:
 
     void optimize()
     {
-        // TODO
+        _generator->optimize();
+    }
+
+    bool tellIfConstant(std::string &value, size_t maxSize)
+    {
+        std::string repeated;
+        if (_from != _to || (_from > 0 && !_generator->tellIfConstant(repeated, maxSize / _from))) {
+            return false;
+        }
+        for (int i = 0; i < _from; i++) {
+            value += repeated;
+        }
+        return true;
+    }
+
+    size_t memoryFootprint()
+    {
+        return sizeof(*this) + _generator->memoryFootprint();
     }
 };
 
@@ -153,18 +514,28 @@ class SeriesOfGeneratorsGenerator : public Generator
 private:
     std::vector<std::unique_ptr<Generator>> _generators;
 public:
+    using Generator::generate;
+    using Generator::generateBatch;
+
     void swapContents(std::vector<std::unique_ptr<Generator>> &generators)
     {
         _generators.swap(generators);
     }
 
-    void generate(std::stringstream &output)
+    void generate(std::string &output)
     {
         for (auto &generator : _generators) {
             generator->generate(output);
         }
     }
 
+    void generateBatch(std::string *const *outputs, size_t count)
+    {
+        for (auto &generator : _generators) {
+            generator->generateBatch(outputs, count);
+        }
+    }
+
     bool isEmpty()
     {
         return _generators.size() == 0;
@@ -183,6 +554,27 @@ public:
 
         _generators.erase(emptyBegin, _generators.end()); 
     }
+
+    bool tellIfConstant(std::string &value, size_t maxSize)
+    {
+        std::string concatenated;
+        for (auto &gen : _generators) {
+            if (!gen->tellIfConstant(concatenated, maxSize - concatenated.size())) {
+                return false;
+            }
+        }
+        value += concatenated;
+        return true;
+    }
+
+    size_t memoryFootprint()
+    {
+        size_t total = sizeof(*this) + heapBytes(_generators);
+        for (auto &gen : _generators) {
+            total += gen->memoryFootprint();
+        }
+        return total;
+    }
 };
 
 template<typename RandNumGenerator>
@@ -190,65 +582,293 @@ class AlternativeOfGeneratorsGenerator : public Generator
 {
 private:
     std::vector<std::unique_ptr<Generator>> _generators;
+    // Once optimized, alternatives which are all constant (like long lists of
+    // words) are kept back to back in _constants instead of _generators, and
+    // _constantEnds[i] tells where the i-th of them ends.
+    std::string _constants;
+    std::vector<uint32_t> _constantEnds;
     RandNumGenerator _randNumGenerator;
+
+    // Longer alternatives aren't compacted, so (a{300000000}|b) isn't spelled out.
+    static const size_t MAX_CONSTANT_SIZE = 4096;
+
+    void appendConstant(size_t index, std::string &output)
+    {
+        size_t begin = index > 0 ? _constantEnds[index - 1] : 0;
+        output.append(_constants, begin, _constantEnds[index] - begin);
+    }
+
 public:
+    using Generator::generate;
+    using Generator::generateBatch;
+
     void swapContents(std::vector<std::unique_ptr<Generator>> &generators)
     {
         _generators.swap(generators);
     }
 
-    void generate(std::stringstream &output)
+    void generate(std::string &output)
+    {
+        if (!_constantEnds.empty()) {
+            appendConstant(randomBelow(_randNumGenerator, _constantEnds.size()), output);
+            return;
+        }
+        _generators[randomBelow(_randNumGenerator, _generators.size())]->generate(output);
+    }
+
+    void generateBatch(std::string *const *outputs, size_t count)
     {
-        _generators[_randNumGenerator.get() % _generators.size()]->generate(output);
+        if (!_constantEnds.empty()) {
+            const uint32_t size = _constantEnds.size();
+            for (size_t i = 0; i < count; i++) {
+                appendConstant(randomBelow(_randNumGenerator, size), *outputs[i]);
+            }
+            return;
+        }
+
+        const size_t size = _generators.size();
+        std::vector<uint32_t> choices(count);
+        std::vector<size_t> offsets(size + 1);
+        for (size_t i = 0; i < count; i++) {
+            choices[i] = randomBelow(_randNumGenerator, size);
+            offsets[choices[i] + 1]++;
+        }
+        for (size_t i = 0; i < size; i++) {
+            offsets[i + 1] += offsets[i];
+        }
+
+        // Counting sort of the outputs by the chosen alternative, so that
+        // each alternative is visited once with all outputs which chose it.
+        std::vector<std::string *> partitioned(count);
+        std::vector<size_t> positions(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < count; i++) {
+            partitioned[positions[choices[i]]++] = outputs[i];
+        }
+        for (size_t i = 0; i < size; i++) {
+            if (offsets[i + 1] > offsets[i]) {
+                _generators[i]->generateBatch(partitioned.data() + offsets[i], offsets[i + 1] - offsets[i]);
+            }
+        }
     }
 
     bool isEmpty()
     {
-        return _generators.size() == 0;
+        return _generators.size() == 0 && _constantEnds.size() == 0;
     }
 
     void optimize()
     {
-        // TODO
+        for (auto &gen : _generators) {
+            gen->optimize();
+        }
+
+        std::string constants;
+        std::vector<uint32_t> constantEnds;
+        for (auto &gen : _generators) {
+            if (!gen->tellIfConstant(constants, MAX_CONSTANT_SIZE) || constants.size() > UINT32_MAX) {
+                return;
+            }
+            constantEnds.push_back(constants.size());
+        }
+        if (constantEnds.size() < 2) {
+            return; // a single constant is cheap enough as it is
+        }
+
+        constants.shrink_to_fit();
+        constantEnds.shrink_to_fit();
+        _constants.swap(constants);
+        _constantEnds.swap(constantEnds);
+        std::vector<std::unique_ptr<Generator>>().swap(_generators);
+    }
+
+    bool tellIfConstant(std::string &value, size_t maxSize)
+    {
+        return _generators.size() == 1 && _generators[0]->tellIfConstant(value, maxSize);
+    }
+
+    size_t memoryFootprint()
+    {
+        size_t total = sizeof(*this) + heapBytes(_generators) + heapBytes(_constants) + heapBytes(_constantEnds);
+        for (auto &gen : _generators) {
+            total += gen->memoryFootprint();
+        }
+        return total;
     }
 };
 
 class PlainRandomNumberGenerator
 {
 public:
+    static void seed(uint64_t value)
+    {
+        srand(static_cast<unsigned>(value));
+    }
+
     int get()
     {
         return rand();
     }
 };
 
-const int EOL = -1;
-
-template<typename FileReader = PlainFileReader,
-         typename RandNumGenerator = PlainRandomNumberGenerator>
-class RegexParser {
+/* Keeps its engine per thread, so each thread can seed it and get
+ * a reproducible sequence of strings, regardless of other threads. */
+class SeededRandomNumberGenerator
+{
 public:
+    static void seed(uint64_t value)
+    {
+        std::seed_seq seq{static_cast<uint32_t>(value), static_cast<uint32_t>(value >> 32)};
+        engine().seed(seq);
+    }
 
-    static std::unique_ptr<Generator> parseExpression(const std::string &regex)
+    // Snapshot of this thread's engine, e.g. for checkpoints of long jobs.
+    static void saveState(std::ostream &stream)
     {
-        MapOfGenerators mapOfGenerators;
-        RegexParser regexParser;
-        return regexParser.parseRegex(regex, mapOfGenerators, true);
+        stream << engine();
     }
 
-    static std::unique_ptr<Generator> parseExpression(const std::string &regex, const MapOfGenerators &generatorsMap)
+    static bool loadState(std::istream &stream)
     {
-        RegexParser regexParser;
-        return regexParser.parseRegex(regex, generatorsMap);
+        std::mt19937 restored;
+        if (!(stream >> restored)) {
+            return false;
+        }
+        engine() = restored;
+        return true;
     }
 
-private:
+    int get()
+    {
+        // Same range as rand() on glibc, i.e. 31 random bits.
+        return static_cast<int>(engine()() >> 1);
+    }
 
-    typedef CharAlternativeGenerator<RandNumGenerator> CharAlternativeGenerator_;
-    typedef AlternativeOfGeneratorsGenerator<RandNumGenerator> AlternativeOfGeneratorsGenerator_;
-    typedef RepetitionsGenerator<RandNumGenerator> RepetitionsGenerator_;
+private:
+    static std::mt19937 &engine()
+    {
+        static thread_local std::mt19937 instance;
+        return instance;
+    }
+};
 
-    RegexParser() : _generators(2) {}
+/* Adapts a policy whose get() gives 31 uniformly random bits (like rand() on
+ * glibc) so that bounded draws are exactly uniform and cheap in entropy.
+ * Bits are kept in a per-thread pool holding a number uniform in [0, range);
+ * a draw below bound takes the remainder modulo bound and keeps the quotient
+ * for later draws, so e.g. [a-z] needs about a sixth of a get() per char.
+ * The rare values which would bias a draw are rejected, but even then what's
+ * left of them stays in the pool. */
+template<typename RandNumGenerator>
+class EntropyPoolingRandomNumberGenerator
+{
+public:
+    static void seed(uint64_t value)
+    {
+        RandNumGenerator::seed(value);
+        pool() = Pool();
+    }
+
+    static void saveState(std::ostream &stream)
+    {
+        RandNumGenerator::saveState(stream);
+        stream << ' ' << pool().value << ' ' << pool().range;
+    }
+
+    static bool loadState(std::istream &stream)
+    {
+        Pool restored;
+        if (!RandNumGenerator::loadState(stream) || !(stream >> restored.value >> restored.range)) {
+            return false;
+        }
+        pool() = restored;
+        return true;
+    }
+
+    int get()
+    {
+        return _randNumGenerator.get();
+    }
+
+    uint32_t getBounded(uint32_t bound)
+    {
+        Pool &p = pool();
+        for (;;) {
+            // A range of at least 2^32 makes a rejection unlikely even for
+            // the largest bounds (2^31), and 2^32 << 31 still fits in 64 bits.
+            while (p.range < (UINT64_C(1) << 32)) {
+                p.value = (p.value << 31) | (static_cast<uint64_t>(_randNumGenerator.get()) & 0x7fffffff);
+                p.range <<= 31;
+            }
+
+            uint64_t quotient = p.range / bound;
+            uint64_t limit = quotient * bound;
+            if (p.value < limit) {
+                uint32_t result = p.value % bound;
+                p.value /= bound;
+                p.range = quotient;
+                return result;
+            }
+            p.value -= limit;
+            p.range -= limit;
+        }
+    }
+
+private:
+    struct Pool
+    {
+        uint64_t value = 0;
+        uint64_t range = 1;
+    };
+
+    RandNumGenerator _randNumGenerator;
+
+    static Pool &pool()
+    {
+        static thread_local Pool instance;
+        return instance;
+    }
+};
+
+const int EOL = -1;
+
+template<typename FileReader = PlainFileReader,
+         typename RandNumGenerator = PlainRandomNumberGenerator>
+class RegexParser {
+public:
+
+    static std::unique_ptr<Generator> parseExpression(const std::string &regex)
+    {
+        MapOfGenerators mapOfGenerators;
+        RegexParser regexParser;
+        return regexParser.parseRegex(regex, mapOfGenerators, true);
+    }
+
+    static std::unique_ptr<Generator> parseExpression(const std::string &regex, const MapOfGenerators &generatorsMap)
+    {
+        RegexParser regexParser;
+        return regexParser.parseRegex(regex, generatorsMap);
+    }
+
+    // Gives nullptr and the first error if the expression isn't valid.
+    static std::unique_ptr<Generator> parseExpression(const std::string &regex, const MapOfGenerators &generatorsMap,
+                                                      std::string &errMsg)
+    {
+        RegexParser regexParser;
+        auto generator = regexParser.parseRegex(regex, generatorsMap);
+        if (!regexParser._parseErrors.empty()) {
+            errMsg = regexParser._parseErrors.front();
+            return nullptr;
+        }
+        return generator;
+    }
+
+private:
+
+    typedef CharAlternativeGenerator<RandNumGenerator> CharAlternativeGenerator_;
+    typedef AlternativeOfGeneratorsGenerator<RandNumGenerator> AlternativeOfGeneratorsGenerator_;
+    typedef RepetitionsGenerator<RandNumGenerator> RepetitionsGenerator_;
+
+    RegexParser() : _generators(2) {}
 
     RegexParser(const RegexParser &) = delete;
 
@@ -258,6 +878,7 @@ private:
         VARIABLE_NAME, // $foo
         REPETITIONS_SPECS, // {1,10} or {10}, or {,10}, etc.
         BACKSLASH, // for special characters
+        UNICODE_ESCAPE, // \u{263a}
     };
 
     std::stack<State> _stateStack;
@@ -267,6 +888,12 @@ private:
     std::stringstream _stream;
     std::vector<int> _repetitions;
     bool _wasDashInCharAlternative = false;
+    std::vector<CharRange> _charRanges;
+    uint32_t _codePoint = 0;
+    bool _wasBackslashU = false;
+    int _escapeDigits = 0;
+    int _missingUtf8Bytes = 0;
+    uint32_t _minUtf8CodePoint = 0;
     std::vector<std::string> _parseErrors;
 
     static bool isDigit(int c)
@@ -319,7 +946,10 @@ private:
                 break;
             case ')':
                 pushGenerator<ConstGenerator>(_stream);
-                assert(_generators.size() >= 3);
+                if (_generators.size() < 3) {
+                    _parseErrors.push_back("Unmatched )");
+                    break;
+                }
 
                 {
                     auto seriesGen = std::unique_ptr<SeriesOfGeneratorsGenerator>
@@ -361,8 +991,13 @@ private:
 
             case EOL:
                 pushGenerator<ConstGenerator>(_stream);
-                
-                assert(_generators.size() == 2);
+
+                if (_generators.size() > 2) {
+                    _parseErrors.push_back("Unmatched (");
+                    while (_generators.size() > 2) {
+                        processCharInDefaultState(')');
+                    }
+                }
 
                 {
                     auto seriesGen = std::unique_ptr<SeriesOfGeneratorsGenerator>
@@ -386,13 +1021,18 @@ private:
         }
     }
 
-    void processCharInRepetitionsSpecsState(int character)
+    bool processCharInRepetitionsSpecsStateAndTellIfShouldRerun(int character)
     {
         if (isDigit(character)) {
             _stream << static_cast<char>(character);
+        } else if (character != ',' && character != '}') {
+            // The spec is dropped, whatever follows is parsed as usual.
+            _parseErrors.push_back("Unexpected char in repetitions spec");
+            _stream.str("");
+            _repetitions.clear();
+            restoreState();
+            return true;
         } else {
-            assert(character == ',' || character == '}');
-
             int val = atoi(_stream.str().c_str());
             _stream.str("");
             _repetitions.push_back(val);
@@ -403,21 +1043,106 @@ private:
                     _repetitions.push_back(_repetitions.front());
                 }
 
-                assert(_generators.back().size() > 0);
-
-                auto prevGenerator = std::move(_generators.back().back());
-                _generators.back().pop_back();
-                _generators.back().push_back(std::unique_ptr<RepetitionsGenerator_>
-                        (new RepetitionsGenerator_(_repetitions[0], _repetitions[1],
-                                                   std::move(prevGenerator))));
+                if (_repetitions.size() > 2 || _repetitions[0] > _repetitions[1]) {
+                    _parseErrors.push_back("Invalid repetitions spec");
+                } else if (_generators.back().empty()) {
+                    _parseErrors.push_back("Nothing to repeat");
+                } else {
+                    auto prevGenerator = std::move(_generators.back().back());
+                    _generators.back().pop_back();
+                    _generators.back().push_back(std::unique_ptr<RepetitionsGenerator_>
+                            (new RepetitionsGenerator_(_repetitions[0], _repetitions[1],
+                                                       std::move(prevGenerator))));
+                }
 
+                _repetitions.clear();
                 restoreState();
             }
         }
+        return false;
+    }
+
+    void addCodePointToCharAlternative(uint32_t codePoint)
+    {
+        if (_wasDashInCharAlternative) {
+            _wasDashInCharAlternative = false;
+            if (_charRanges.empty()) {
+                _charRanges.push_back(CharRange{'-', '-'});
+            } else {
+                CharRange &previous = _charRanges.back();
+                if (previous.last >= codePoint) {
+                    // TODO: maybe it'd be better to throw an error than silently ignore
+                    return;
+                }
+                previous.last = codePoint;
+                return;
+            }
+        }
+        _charRanges.push_back(CharRange{codePoint, codePoint});
     }
 
-    void processCharInCharAlternativeState(int character)
+    // Decodes UTF-8 so that multi-byte chars are single choices of the class.
+    void processByteInCharAlternative(int character)
     {
+        if (_missingUtf8Bytes > 0) {
+            if ((character & 0xc0) != 0x80) {
+                _parseErrors.push_back("Invalid UTF-8 in char alternative");
+                _missingUtf8Bytes = 0;
+                return;
+            }
+            _codePoint = (_codePoint << 6) | (character & 0x3f);
+            if (--_missingUtf8Bytes == 0) {
+                // Overlong forms, like C0 80 for NUL, are invalid as well.
+                if (isSurrogate(_codePoint) || _codePoint > 0x10ffff || _codePoint < _minUtf8CodePoint) {
+                    _parseErrors.push_back("Invalid UTF-8 in char alternative");
+                } else {
+                    addCodePointToCharAlternative(_codePoint);
+                }
+            }
+            return;
+        }
+
+        if (character < 0x80) {
+            addCodePointToCharAlternative(character);
+        } else if ((character & 0xe0) == 0xc0) {
+            _codePoint = character & 0x1f;
+            _missingUtf8Bytes = 1;
+            _minUtf8CodePoint = 0x80;
+        } else if ((character & 0xf0) == 0xe0) {
+            _codePoint = character & 0x0f;
+            _missingUtf8Bytes = 2;
+            _minUtf8CodePoint = 0x800;
+        } else if ((character & 0xf8) == 0xf0) {
+            _codePoint = character & 0x07;
+            _missingUtf8Bytes = 3;
+            _minUtf8CodePoint = 0x10000;
+        } else {
+            _parseErrors.push_back("Invalid UTF-8 in char alternative");
+        }
+    }
+
+    void pushCharAlternativeGenerator()
+    {
+        if (_wasDashInCharAlternative) {
+            // A trailing dash, as in [a-], stands for itself.
+            _wasDashInCharAlternative = false;
+            _charRanges.push_back(CharRange{'-', '-'});
+        }
+        if (_charRanges.size() > 0) {
+            _generators.back().push_back(std::unique_ptr<CharAlternativeGenerator_>
+                    (new CharAlternativeGenerator_(std::move(_charRanges))));
+            _charRanges.clear();
+        }
+    }
+
+    bool processCharInCharAlternativeStateAndTellIfShouldRerun(int character)
+    {
+        if (_missingUtf8Bytes > 0 && (character & 0xc0) != 0x80) {
+            // Also at ] and EOL, so the sequence doesn't spill into the next class.
+            _parseErrors.push_back("Truncated UTF-8 in char alternative");
+            _missingUtf8Bytes = 0;
+        }
+
         switch (character) {
             case '\\':
                 setState(BACKSLASH);
@@ -427,24 +1152,102 @@ private:
                 break;
             case ']':
                 restoreState();
-            case EOL:
-                pushGenerator<CharAlternativeGenerator_>(_stream);
+                pushCharAlternativeGenerator();
                 break;
+            case EOL:
+                _parseErrors.push_back("Unterminated char alternative");
+                restoreState();
+                pushCharAlternativeGenerator();
+                return true;
             default:
-                if (_wasDashInCharAlternative) {
-                    _wasDashInCharAlternative = false;
-                    char from = _stream.str().back();
-                    if (from >= character) {
-                        // TODO: maybe it'd be better to throw an error than silently ignore
-                        break;
-                    }
-                    for (char ch = from + 1; ch <= character; ch++) {
-                        _stream << static_cast<char>(ch);
-                    }
-                } else {
-                    _stream << static_cast<char>(character);    
+                processByteInCharAlternative(character);
+        }
+        return false;
+    }
+
+    bool processCharInBackslashStateAndTellIfShouldRerun(int character)
+    {
+        if (_wasBackslashU) {
+            _wasBackslashU = false;
+            if (character == '{') {
+                _state = UNICODE_ESCAPE;
+                _codePoint = 0;
+                _escapeDigits = 0;
+                return false;
+            }
+            // Not an escape after all, \u stands for u as it always did.
+            addEscapedByte('u');
+            return true;
+        }
+        if (character == 'u') {
+            _wasBackslashU = true;
+            return false;
+        }
+        if (character == EOL) {
+            _parseErrors.push_back("Backslash at the end of expression");
+            restoreState();
+            return true;
+        }
+        addEscapedByte(character);
+        return false;
+    }
+
+    // Leaves the backslash state, adding the byte to whatever it was in.
+    void addEscapedByte(int character)
+    {
+        restoreState();
+        if (_state == CHAR_ALTERNATIVE) {
+            processByteInCharAlternative(character);
+        } else {
+            _stream << static_cast<char>(character);
+        }
+    }
+
+    bool processCharInUnicodeEscapeStateAndTellIfShouldRerun(int character)
+    {
+        if (character == EOL) {
+            _parseErrors.push_back("Unterminated \\u{...} escape");
+            restoreState();
+            return true;
+        }
+        if (character != '}') {
+            int digit = isDigit(character) ? character - '0'
+                      : (character >= 'a' && character <= 'f') ? character - 'a' + 10
+                      : (character >= 'A' && character <= 'F') ? character - 'A' + 10
+                      : -1;
+            if (digit < 0) {
+                _parseErrors.push_back("Invalid \\u{...} escape");
+            } else {
+                _escapeDigits++;
+                if (_codePoint <= 0x10ffff) {
+                    // Stops shifting once out of range, so it can't wrap around.
+                    _codePoint = (_codePoint << 4) | digit;
                 }
+            }
+            return false;
         }
+
+        restoreState();
+        if (_escapeDigits == 0) {
+            _parseErrors.push_back("Empty \\u{} escape");
+            return false;
+        }
+        if (_codePoint > 0x10ffff) {
+            _parseErrors.push_back("Code point above 10FFFF in \\u{...} escape");
+            return false;
+        }
+        if (isSurrogate(_codePoint)) {
+            _parseErrors.push_back("Surrogate in \\u{...} escape");
+            return false;
+        }
+        if (_state == CHAR_ALTERNATIVE) {
+            addCodePointToCharAlternative(_codePoint);
+        } else {
+            std::string encoded;
+            appendUtf8(_codePoint, encoded);
+            _stream << encoded;
+        }
+        return false;
     }
 
     bool processCharInVariableNameStateAndTellIfShouldReturn(int character, const MapOfGenerators &mapOfGenerators)
@@ -466,23 +1269,23 @@ private:
                 processCharInDefaultState(character);
                 break;
             case REPETITIONS_SPECS:
-                processCharInRepetitionsSpecsState(character);
-                break;
+                return processCharInRepetitionsSpecsStateAndTellIfShouldRerun(character);
             case VARIABLE_NAME:
                 if (varsNotAllowed) {
+                    // The name is kept as plain text.
                     _parseErrors.push_back("Variable usages not allowed in this instance");
-                    return false;
+                    restoreState();
+                    return true;
                 }
                 if (processCharInVariableNameStateAndTellIfShouldReturn(character, mapOfGenerators))
                     return true;
                 break;
             case CHAR_ALTERNATIVE:
-                processCharInCharAlternativeState(character);
-                break;
+                return processCharInCharAlternativeStateAndTellIfShouldRerun(character);
             case BACKSLASH:
-                _stream << static_cast<char>(character);
-                restoreState();
-                break;
+                return processCharInBackslashStateAndTellIfShouldRerun(character);
+            case UNICODE_ESCAPE:
+                return processCharInUnicodeEscapeStateAndTellIfShouldRerun(character);
         }
 
         return false;
@@ -495,7 +1298,10 @@ private:
             while (processCharAndTellIfShouldRerun(character, mapOfGenerators, varsNotAllowed));
         };
 
-        std::for_each(regex.begin(), regex.end(), processChar);
+        // As unsigned, so that bytes of UTF-8 sequences don't look like EOL.
+        for (unsigned char character : regex) {
+            processChar(character);
+        }
         processChar(EOL);
 
         if (_state != DEFAULT) {
@@ -506,18 +1312,234 @@ private:
     }
 };
 
+/* Strings generated lazily, one per step of iteration, e.g.
+ *
+ *     for (std::string_view s : Randodo::stream<Policy>(generator, 1000, seed)) ...
+ *
+ * The views point into a buffer which gets reused, so each of them is valid
+ * only until the iteration moves on. RandNumGenerator must be the policy the
+ * generator was parsed with, it gets seeded when the iteration begins; see
+ * also ConfigFile::stream(), which picks it on its own. Iterators model input
+ * iterators and end() is a sentinel, so a range like this also works with
+ * C++20 std::ranges views. */
+template<typename RandNumGenerator>
+class GeneratedStrings
+{
+public:
+    struct Sentinel {};
+
+    class Iterator
+    {
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef std::input_iterator_tag iterator_concept;
+        typedef std::string_view value_type;
+        typedef std::string_view reference;
+        typedef void pointer;
+        typedef std::ptrdiff_t difference_type;
+
+        Iterator() {}
+
+        explicit Iterator(GeneratedStrings *owner)
+            : _owner(owner) {}
+
+        std::string_view operator*() const
+        {
+            return std::string_view(_owner->_buffer);
+        }
+
+        Iterator &operator++()
+        {
+            _owner->advance();
+            return *this;
+        }
+
+        void operator++(int)
+        {
+            _owner->advance();
+        }
+
+        friend bool operator==(const Iterator &it, Sentinel) { return it.atEnd(); }
+        friend bool operator!=(const Iterator &it, Sentinel) { return !it.atEnd(); }
+        friend bool operator==(Sentinel, const Iterator &it) { return it.atEnd(); }
+        friend bool operator!=(Sentinel, const Iterator &it) { return !it.atEnd(); }
+
+    private:
+        GeneratedStrings *_owner = nullptr;
+
+        bool atEnd() const
+        {
+            return _owner->_left == 0;
+        }
+    };
+
+    // The generator may only be null if howMany is 0.
+    GeneratedStrings(Generator *generator, uint64_t howMany, uint64_t seed)
+        : _generator(generator), _howMany(howMany), _seed(seed) {}
+
+    Iterator begin()
+    {
+        RandNumGenerator::seed(_seed);
+        _left = _howMany;
+        if (_left > 0) {
+            _buffer.clear();
+            _generator->generate(_buffer);
+        }
+        return Iterator(this);
+    }
+
+    Sentinel end()
+    {
+        return Sentinel();
+    }
+
+private:
+    // Not a reference nor const, so the range stays movable (as C++20
+    // views need to be).
+    Generator *_generator;
+    uint64_t _howMany, _seed;
+    uint64_t _left = 0; // including the current one
+    std::string _buffer;
+
+    void advance()
+    {
+        if (--_left > 0) {
+            _buffer.clear();
+            _generator->generate(_buffer);
+        }
+    }
+};
+
+template<typename RandNumGenerator>
+GeneratedStrings<RandNumGenerator> stream(Generator &generator, uint64_t howMany, uint64_t seed)
+{
+    return GeneratedStrings<RandNumGenerator>(&generator, howMany, seed);
+}
+
+/* Like GeneratedStrings, but each step gives a chunk of up to chunkSize
+ * strings made with generateBatch(), which is much faster per string. The
+ * strings differ from those of stream() with the same seed, as batches draw
+ * random numbers in a different order. */
+template<typename RandNumGenerator>
+class GeneratedChunks
+{
+public:
+    struct Sentinel {};
+
+    class Iterator
+    {
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef std::input_iterator_tag iterator_concept;
+        typedef std::vector<std::string_view> value_type;
+        typedef const std::vector<std::string_view> &reference;
+        typedef void pointer;
+        typedef std::ptrdiff_t difference_type;
+
+        Iterator() {}
+
+        explicit Iterator(GeneratedChunks *owner)
+            : _owner(owner) {}
+
+        const std::vector<std::string_view> &operator*() const
+        {
+            return _owner->_views;
+        }
+
+        Iterator &operator++()
+        {
+            _owner->advance();
+            return *this;
+        }
+
+        void operator++(int)
+        {
+            _owner->advance();
+        }
+
+        friend bool operator==(const Iterator &it, Sentinel) { return it.atEnd(); }
+        friend bool operator!=(const Iterator &it, Sentinel) { return !it.atEnd(); }
+        friend bool operator==(Sentinel, const Iterator &it) { return it.atEnd(); }
+        friend bool operator!=(Sentinel, const Iterator &it) { return !it.atEnd(); }
+
+    private:
+        GeneratedChunks *_owner = nullptr;
+
+        bool atEnd() const
+        {
+            return _owner->_views.empty();
+        }
+    };
+
+    GeneratedChunks(Generator *generator, uint64_t howMany, uint64_t seed, size_t chunkSize)
+        : _generator(generator), _howMany(howMany), _seed(seed),
+          _strings(chunkSize), _pointers(chunkSize)
+    {
+        for (size_t i = 0; i < chunkSize; i++) {
+            _pointers[i] = &_strings[i];
+        }
+    }
+
+    Iterator begin()
+    {
+        RandNumGenerator::seed(_seed);
+        _left = _howMany;
+        advance();
+        return Iterator(this);
+    }
+
+    Sentinel end()
+    {
+        return Sentinel();
+    }
+
+private:
+    Generator *_generator; // see GeneratedStrings
+    uint64_t _howMany, _seed;
+    uint64_t _left = 0; // not counting the current chunk
+    std::vector<std::string> _strings;
+    std::vector<std::string *> _pointers;
+    std::vector<std::string_view> _views;
+
+    void advance()
+    {
+        size_t count = std::min<uint64_t>(_left, _strings.size());
+        _left -= count;
+        for (size_t i = 0; i < count; i++) {
+            _strings[i].clear();
+        }
+        if (count > 0) {
+            _generator->generateBatch(_pointers.data(), count);
+        }
+
+        _views.clear();
+        for (size_t i = 0; i < count; i++) {
+            _views.push_back(std::string_view(_strings[i]));
+        }
+    }
+};
+
+template<typename RandNumGenerator>
+GeneratedChunks<RandNumGenerator> streamChunks(Generator &generator, uint64_t howMany, uint64_t seed,
+                                               size_t chunkSize = 256)
+{
+    return GeneratedChunks<RandNumGenerator>(&generator, howMany, seed, chunkSize);
+}
+
 template<typename FileReader = PlainFileReader,
          typename RandNumGenerator = PlainRandomNumberGenerator>
 class ConfigFile
 {
 public:
-    ConfigFile(std::string fileName)
+    ConfigFile(std::string fileName, bool optimizeGenerators = true)
+        : _optimizeGenerators(optimizeGenerators)
     {
         FileReader file(fileName);
         parse(file);
     }
 
-    ConfigFile(FileReader &file)
+    ConfigFile(FileReader &file, bool optimizeGenerators = true)
+        : _optimizeGenerators(optimizeGenerators)
     {
         parse(file);
     }
@@ -532,12 +1554,49 @@ public:
         return _generatorsMap;
     }
 
+    // False if a line couldn't be parsed; the lines after it are skipped.
+    bool isValid() const
+    {
+        return _errMsg.empty();
+    }
+
+    const std::string &getErrMsg() const
+    {
+        return _errMsg;
+    }
+
+    // Lazily generated strings of the named generator (none if there's no
+    // such one), seeded through the policy the file was parsed with.
+    GeneratedStrings<RandNumGenerator> stream(const std::string &generatorName, uint64_t howMany,
+                                              uint64_t seed) const
+    {
+        Generator *generator = find(generatorName);
+        return GeneratedStrings<RandNumGenerator>(generator, generator ? howMany : 0, seed);
+    }
+
+    GeneratedChunks<RandNumGenerator> streamChunks(const std::string &generatorName, uint64_t howMany,
+                                                   uint64_t seed, size_t chunkSize = 256) const
+    {
+        Generator *generator = find(generatorName);
+        return GeneratedChunks<RandNumGenerator>(generator, generator ? howMany : 0, seed, chunkSize);
+    }
+
 private:
 
     std::vector<std::pair<std::string, std::string>> _lines;
 
     MapOfGenerators _generatorsMap;
 
+    const bool _optimizeGenerators;
+
+    std::string _errMsg;
+
+    Generator *find(const std::string &generatorName) const
+    {
+        auto iter = _generatorsMap.find(generatorName);
+        return iter != _generatorsMap.end() ? iter->second.get() : nullptr;
+    }
+
     bool parse(FileReader &file)
     {
         int lineNum = 0;
@@ -547,6 +1606,7 @@ private:
             lineNum++;
             std::string errMsg;
             if (! parseLine(line, errMsg)) {
+                _errMsg = "Line " + std::to_string(lineNum) + ": " + errMsg;
                 return false;
             }
         }
@@ -626,12 +1686,311 @@ private:
 
         std::string &&name = nameStream.str(), &&value = valueStream.str();
         _lines.push_back(std::make_pair(name, value));
-        _generatorsMap.insert(std::make_pair(name, RegexParser<FileReader, RandNumGenerator>::parseExpression(value, _generatorsMap)));
+        auto generator = RegexParser<FileReader, RandNumGenerator>::parseExpression(value, _generatorsMap, errMsg);
+        if (!generator) {
+            return false;
+        }
+        if (_optimizeGenerators) {
+            generator->optimize();
+        }
+        _generatorsMap.insert(std::make_pair(name, std::move(generator)));
+
+        return true;
+    }
+};
+
+
+enum RecordFormat
+{
+    CSV,
+    TSV,
+    JSON_LINES,
+};
+
+/* Generates records (rows) whose columns come from several generators,
+ * formatted and escaped in a single pass into the caller's buffer. */
+class RecordGenerator
+{
+public:
+    RecordGenerator(const MapOfGenerators &mapOfGenerators, RecordFormat format, bool bindVariables = false)
+        : _mapOfGenerators(mapOfGenerators), _format(format), _bindVariables(bindVariables) {}
 
+    bool addColumn(const std::string &name)
+    {
+        auto iter = _mapOfGenerators.find(name);
+        if (iter == _mapOfGenerators.end()) {
+            return false;
+        }
+        _columns.push_back(std::make_pair(name, iter->second.get()));
         return true;
     }
+
+    // Appends the column names line for CSV and TSV; JSON Lines have none.
+    void generateHeader(std::string &output)
+    {
+        if (_format == JSON_LINES) {
+            return;
+        }
+        for (size_t i = 0; i < _columns.size(); i++) {
+            if (i > 0) {
+                output += separator();
+            }
+            appendEscaped(_columns[i].first, output);
+        }
+        output += '\n';
+    }
+
+    // Appends one record, including the trailing newline.
+    void generate(std::string &output)
+    {
+        if (_bindVariables) {
+            _bindings.clear();
+            _bindings.activate();
+        }
+
+        if (_format == JSON_LINES) {
+            output += '{';
+        }
+        for (size_t i = 0; i < _columns.size(); i++) {
+            if (i > 0) {
+                output += separator();
+            }
+            if (_format == JSON_LINES) {
+                appendEscaped(_columns[i].first, output);
+                output += ':';
+            }
+
+            _value.clear();
+            if (_bindVariables) {
+                _bindings.generate(_columns[i].first, *_columns[i].second, _value);
+            } else {
+                _columns[i].second->generate(_value);
+            }
+            appendEscaped(_value, output);
+        }
+        output += _format == JSON_LINES ? "}\n" : "\n";
+
+        if (_bindVariables) {
+            _bindings.deactivate();
+        }
+    }
+
+private:
+    const MapOfGenerators &_mapOfGenerators;
+    const RecordFormat _format;
+    const bool _bindVariables;
+    std::vector<std::pair<std::string, Generator *>> _columns;
+    RowBindings _bindings;
+    std::string _value;
+
+    char separator() const
+    {
+        return _format == TSV ? '\t' : ',';
+    }
+
+    static const char *specialChars(RecordFormat format)
+    {
+        switch (format) {
+            case CSV:
+                return ",\"\r\n";
+            case TSV:
+                return "\t\r\n\\";
+            default:
+                return "\"\\\x01\x02\x03\x04\x05\x06\x07\x08\t\n\x0b\x0c\r\x0e\x0f"
+                       "\x10\x11\x12\x13\x14\x15\x16\x17\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f";
+        }
+    }
+
+    void appendEscaped(const std::string &value, std::string &output)
+    {
+        // strcspn is SIMD-accelerated in common libcs and most values don't
+        // need escaping at all, so find the first special char with it and
+        // copy everything before it in one go. It stops at '\0' too, which
+        // we then handle on the slow path.
+        size_t clean = strcspn(value.c_str(), specialChars(_format));
+
+        if (_format == CSV) {
+            if (clean == value.size()) {
+                output += value;
+                return;
+            }
+            output += '"';
+            for (char ch : value) {
+                if (ch == '"') {
+                    output += '"';
+                }
+                output += ch;
+            }
+            output += '"';
+            return;
+        }
+
+        if (_format == JSON_LINES) {
+            output += '"';
+        }
+        output.append(value, 0, clean);
+        for (size_t i = clean; i < value.size(); i++) {
+            char ch = value[i];
+            if (_format == TSV) {
+                switch (ch) {
+                    case '\t': output += "\\t"; break;
+                    case '\r': output += "\\r"; break;
+                    case '\n': output += "\\n"; break;
+                    case '\\': output += "\\\\"; break;
+                    default: output += ch;
+                }
+                continue;
+            }
+            switch (ch) {
+                case '"': output += "\\\""; break;
+                case '\\': output += "\\\\"; break;
+                case '\t': output += "\\t"; break;
+                case '\r': output += "\\r"; break;
+                case '\n': output += "\\n"; break;
+                default:
+                    if (static_cast<unsigned char>(ch) < 0x20) {
+                        static const char hex[] = "0123456789abcdef";
+                        output += "\\u00";
+                        output += hex[ch >> 4];
+                        output += hex[ch & 0xf];
+                    } else {
+                        output += ch;
+                    }
+            }
+        }
+        if (_format == JSON_LINES) {
+            output += '"';
+        }
+    }
 };
 
+/* Keeps a bounded ring of pre-generated strings filled by a background thread,
+ * so that consumers on a hot path only pay for a pop. The ring is single
+ * producer / single consumer: only one thread may call tryGet(). Generators
+ * aren't thread-safe, so while the queue is alive its generator must not be
+ * used elsewhere, not even by another queue: for several consumers, parse
+ * the generator once per consumer and give each copy a queue of its own.
+ * RandNumGenerator must be the policy the generator was parsed with; the
+ * producer thread seeds it, so a seedable per-thread policy like
+ * SeededRandomNumberGenerator gives each queue the strings of its seed. */
+template<typename RandNumGenerator>
+class PrefetchQueue
+{
+public:
+    struct Stats
+    {
+        size_t depth;
+        uint64_t produced;
+        uint64_t consumed;
+        uint64_t underruns;
+    };
+
+    PrefetchQueue(Generator &generator, uint64_t seed, size_t capacity = 1024)
+        : _generator(generator), _seed(seed), _slots(roundUpToPowerOfTwo(capacity)),
+          _mask(_slots.size() - 1)
+    {
+        _producer = std::thread([this]() { produce(); });
+    }
+
+    PrefetchQueue(const PrefetchQueue &) = delete;
+
+    ~PrefetchQueue()
+    {
+        _stopped.store(true, std::memory_order_relaxed);
+        _producer.join();
+    }
+
+    // On success, where points into a recycled buffer and stays valid
+    // until the next call of tryGet().
+    bool tryGet(std::string_view &where)
+    {
+        uint64_t head = _head.load(std::memory_order_relaxed);
+        if (_holdingSlot) {
+            _holdingSlot = false;
+            _head.store(++head, std::memory_order_release);
+        }
+
+        if (head == _tail.load(std::memory_order_acquire)) {
+            _underruns.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        const std::string &slot = _slots[head & _mask];
+        where = std::string_view(slot.data(), slot.size());
+        _holdingSlot = true;
+        _consumed.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    Stats getStats() const
+    {
+        Stats stats;
+        // Counted from the pops rather than the head, which only moves past
+        // the slot the consumer holds on its next pop. Consumed first: it
+        // never overtakes the tail, so the later tail load can't be behind
+        // it. The two still aren't read at once, so when called from outside
+        // the consumer, the depth is clamped to the ring.
+        stats.consumed = _consumed.load(std::memory_order_acquire);
+        stats.produced = _tail.load(std::memory_order_acquire);
+        stats.depth = stats.produced > stats.consumed
+                    ? std::min<uint64_t>(stats.produced - stats.consumed, _slots.size()) : 0;
+        stats.underruns = _underruns.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+private:
+    Generator &_generator;
+    const uint64_t _seed;
+    std::vector<std::string> _slots;
+    const uint64_t _mask;
+
+    // Head and tail only grow; their difference is the number of filled slots.
+    // Kept on separate cache lines, as they're written by different threads.
+    alignas(64) std::atomic<uint64_t> _head{0};
+    alignas(64) std::atomic<uint64_t> _tail{0};
+    alignas(64) bool _holdingSlot = false;
+    std::atomic<uint64_t> _consumed{0};
+    std::atomic<uint64_t> _underruns{0};
+
+    std::atomic<bool> _stopped{false};
+    std::thread _producer;
+
+    static size_t roundUpToPowerOfTwo(size_t n)
+    {
+        size_t result = 2;
+        while (result < n) {
+            result <<= 1;
+        }
+        return result;
+    }
+
+    void produce()
+    {
+        RandNumGenerator::seed(_seed);
+
+        int idleRounds = 0;
+        while (!_stopped.load(std::memory_order_relaxed)) {
+            uint64_t tail = _tail.load(std::memory_order_relaxed);
+            if (tail - _head.load(std::memory_order_acquire) == _slots.size()) {
+                // Full: spin for a while, then back off so an idle consumer
+                // doesn't cost a whole core.
+                if (++idleRounds < 1000) {
+                    std::this_thread::yield();
+                } else {
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+                }
+                continue;
+            }
+            idleRounds = 0;
+
+            std::string &slot = _slots[tail & _mask];
+            slot.clear();
+            _generator.generate(slot);
+            _tail.store(tail + 1, std::memory_order_release);
+        }
+    }
+};
 
 }
 
+#endif
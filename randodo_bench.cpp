@@ -0,0 +1,370 @@
+/* License: GPL v2 */
+/* Contact author: wrochniak@gmail.com */
+
+#include "randodo.h"
+
+#include <cstdio>
+
+#ifdef __linux__
+#include <cstring>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+class StringFileReader
+{
+private:
+    std::stringstream _contents;
+
+public:
+    StringFileReader(const std::string &contents)
+        : _contents(contents) {}
+
+    bool readLine(std::string &where)
+    {
+        return static_cast<bool>(std::getline(_contents, where));
+    }
+};
+
+// Counts how many times the wrapped policy is asked for random bits.
+template<typename RandNumGenerator>
+class CountingRandomNumberGenerator
+{
+public:
+    static uint64_t calls;
+
+    static void seed(uint64_t value)
+    {
+        RandNumGenerator::seed(value);
+    }
+
+    int get()
+    {
+        calls++;
+        return _randNumGenerator.get();
+    }
+
+private:
+    RandNumGenerator _randNumGenerator;
+};
+
+template<typename RandNumGenerator>
+uint64_t CountingRandomNumberGenerator<RandNumGenerator>::calls = 0;
+
+typedef CountingRandomNumberGenerator<Randodo::SeededRandomNumberGenerator> CountingGenerator;
+typedef Randodo::EntropyPoolingRandomNumberGenerator<CountingGenerator> PoolingGenerator;
+
+/* Hardware performance counters of the calling thread, read with
+ * perf_event_open(2). Counters the kernel or the CPU doesn't provide (e.g. in
+ * VMs, or with a strict perf_event_paranoid) are just reported unavailable. */
+class PerfCounters
+{
+public:
+    enum Counter
+    {
+        CYCLES,
+        INSTRUCTIONS,
+        BRANCH_MISSES,
+        L1D_MISSES,
+        LLC_MISSES,
+        COUNTERS,
+    };
+
+    static const char *name(Counter counter)
+    {
+        static const char *names[COUNTERS] = {"cycles", "instrs", "br-miss", "L1d-miss", "LLC-miss"};
+        return names[counter];
+    }
+
+    // Cycles lead a group, so that all counters cover exactly the same
+    // stretch of time; events which can't join it get counted on their own.
+    PerfCounters()
+    {
+        _fds[CYCLES] = open(CYCLES, -1);
+        _groupIndex[CYCLES] = _fds[CYCLES] >= 0 ? 0 : -1;
+        int groupSize = _fds[CYCLES] >= 0 ? 1 : 0;
+        for (int i = CYCLES + 1; i < COUNTERS; i++) {
+            _fds[i] = groupSize > 0 ? open(static_cast<Counter>(i), _fds[CYCLES]) : -1;
+            if (_fds[i] >= 0) {
+                _groupIndex[i] = groupSize++;
+            } else {
+                _fds[i] = open(static_cast<Counter>(i), -1);
+                _groupIndex[i] = -1;
+            }
+        }
+    }
+
+    PerfCounters(const PerfCounters &) = delete;
+
+    ~PerfCounters()
+    {
+#ifdef __linux__
+        for (int fd : _fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+#endif
+    }
+
+    bool anyAvailable() const
+    {
+        for (int fd : _fds) {
+            if (fd >= 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void start()
+    {
+#ifdef __linux__
+        for (int i = 0; i < COUNTERS; i++) {
+            if (_fds[i] >= 0 && _groupIndex[i] <= 0) {
+                // The leader resets and enables its whole group.
+                unsigned long flags = _groupIndex[i] == 0 ? PERF_IOC_FLAG_GROUP : 0;
+                ioctl(_fds[i], PERF_EVENT_IOC_RESET, flags);
+                ioctl(_fds[i], PERF_EVENT_IOC_ENABLE, flags);
+            }
+        }
+#endif
+    }
+
+    // Counts since start(); negative for counters which are unavailable.
+    void stop(double (&values)[COUNTERS])
+    {
+        for (int i = 0; i < COUNTERS; i++) {
+            values[i] = -1;
+        }
+#ifdef __linux__
+        for (int i = 0; i < COUNTERS; i++) {
+            if (_fds[i] >= 0 && _groupIndex[i] <= 0) {
+                ioctl(_fds[i], PERF_EVENT_IOC_DISABLE, _groupIndex[i] == 0 ? PERF_IOC_FLAG_GROUP : 0);
+            }
+        }
+
+        uint64_t data[3 + COUNTERS]; // number of values, time enabled, time running, values
+        ssize_t got = _groupIndex[CYCLES] == 0 ? read(_fds[CYCLES], data, sizeof(data)) : 0;
+        for (int i = 0; i < COUNTERS; i++) {
+            if (_groupIndex[i] >= 0) {
+                if (got >= static_cast<ssize_t>(sizeof(uint64_t) * (4 + _groupIndex[i]))) {
+                    values[i] = scaled(data[3 + _groupIndex[i]], data[1], data[2]);
+                }
+            } else if (_fds[i] >= 0) {
+                uint64_t single[3]; // value, time enabled, time running
+                if (read(_fds[i], single, sizeof(single)) == sizeof(single)) {
+                    values[i] = scaled(single[0], single[1], single[2]);
+                }
+            }
+        }
+#endif
+    }
+
+private:
+    int _fds[COUNTERS];
+    int _groupIndex[COUNTERS]; // position in the cycles group, -1 if counted alone
+
+    // Scaled up, in case the kernel had to multiplex the counters.
+    static double scaled(uint64_t value, uint64_t timeEnabled, uint64_t timeRunning)
+    {
+        return timeRunning > 0 ? static_cast<double>(value) * timeEnabled / timeRunning : -1;
+    }
+
+    // Opens the counter on its own, or as a member of groupFd's group.
+    static int open(Counter counter, int groupFd)
+    {
+#ifdef __linux__
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        // Group members follow their leader, which starts disabled.
+        attr.disabled = groupFd < 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        if (counter == CYCLES || groupFd >= 0) {
+            attr.read_format |= PERF_FORMAT_GROUP;
+        }
+
+        const uint64_t readMiss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        switch (counter) {
+            case CYCLES:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CPU_CYCLES;
+                break;
+            case INSTRUCTIONS:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+                break;
+            case BRANCH_MISSES:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+                break;
+            case L1D_MISSES:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_L1D | readMiss;
+                break;
+            default:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_LL | readMiss;
+        }
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0));
+#else
+        (void) counter;
+        (void) groupFd;
+        return -1;
+#endif
+    }
+};
+
+struct Workload
+{
+    const char *name;
+    std::string spec;
+    const char *generatorName;
+};
+
+enum Engine
+{
+    SCALAR,
+    BATCH,
+};
+
+static std::vector<Workload> makeWorkloads()
+{
+    std::string words = "words=(";
+    for (int i = 0; i < 1000; i++) {
+        words += (i > 0 ? "|word" : "word") + std::to_string(i);
+    }
+    words += ")\n";
+
+    return {
+        {"lowercase", "lowercase=[a-z]{16}\n", "lowercase"},
+        {"alnum", "alnum=[a-zA-Z0-9]{8,32}\n", "alnum"},
+        {"words", words, "words"},
+        {"sentence",
+         "male=(John|Paul|Martin|Hubert|Bozydar)\n"
+         "female=(Ann|Sharon|Liza|Janina)\n"
+         "verb=(loves|hates|likes|ignores)\n"
+         "how_much=(| very{1,5} much)\n"
+         "result=$male $verb $female$how_much. By the way, here are 5 random letters: [a-zA-Z]{5}.\n",
+         "result"},
+    };
+}
+
+struct Result
+{
+    std::string name;
+    int howMany;
+    uint64_t bytes;
+    double seconds;
+    double rngCalls;
+    double counters[PerfCounters::COUNTERS];
+};
+
+template<typename RandNumGenerator>
+static Result run(const Workload &workload, Engine engine, const char *rngName, int howMany,
+                  PerfCounters &perfCounters)
+{
+    StringFileReader reader(workload.spec);
+    Randodo::ConfigFile<StringFileReader, RandNumGenerator> configFile(reader);
+    Randodo::Generator &generator = *configFile.getMapOfGenerators().find(workload.generatorName)->second;
+
+    RandNumGenerator::seed(1);
+    CountingGenerator::calls = 0;
+
+    const int batchSize = 256;
+    std::vector<std::string> batch(batchSize);
+    std::string output;
+    uint64_t bytes = 0;
+
+    Result result;
+    auto start = std::chrono::steady_clock::now();
+    perfCounters.start();
+    if (engine == SCALAR) {
+        for (int i = 0; i < howMany; i++) {
+            output.clear();
+            generator.generate(output);
+            bytes += output.size();
+        }
+    } else {
+        for (int done = 0; done < howMany; done += batchSize) {
+            batch.resize(std::min(batchSize, howMany - done));
+            for (auto &value : batch) {
+                value.clear();
+            }
+            generator.generateBatch(batch);
+            for (auto &value : batch) {
+                bytes += value.size();
+            }
+        }
+    }
+    perfCounters.stop(result.counters);
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    result.name = std::string(workload.name) + "/" + (engine == SCALAR ? "scalar" : "batch") + "/" + rngName;
+    result.howMany = howMany;
+    result.bytes = bytes;
+    result.rngCalls = CountingGenerator::calls;
+    return result;
+}
+
+// Prints each of the counters divided by the number of strings, or of bytes.
+static void printCounters(const std::vector<Result> &results, bool perByte)
+{
+    printf("\n%-26s", perByte ? "per byte" : "per string");
+    for (int i = 0; i < PerfCounters::COUNTERS; i++) {
+        printf(" %10s", PerfCounters::name(static_cast<PerfCounters::Counter>(i)));
+    }
+    printf("\n");
+
+    for (const Result &result : results) {
+        double divisor = perByte ? result.bytes : result.howMany;
+        printf("%-26s", result.name.c_str());
+        for (double value : result.counters) {
+            if (value < 0) {
+                printf(" %10s", "-");
+            } else {
+                printf(" %10.2f", value / divisor);
+            }
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int howMany = 200000;
+    if (argc > 1) {
+        howMany = atoi(argv[1]);
+    }
+
+    PerfCounters perfCounters;
+    std::vector<Result> results;
+    for (const Workload &workload : makeWorkloads()) {
+        for (Engine engine : {SCALAR, BATCH}) {
+            results.push_back(run<CountingGenerator>(workload, engine, "plain", howMany, perfCounters));
+            results.push_back(run<PoolingGenerator>(workload, engine, "pooling", howMany, perfCounters));
+        }
+    }
+
+    printf("%-26s %10s %10s %12s\n", "workload/engine/rng", "ns/string", "MB/s", "rng calls/B");
+    for (const Result &result : results) {
+        printf("%-26s %10.1f %10.1f %12.3f\n", result.name.c_str(), result.seconds * 1e9 / result.howMany,
+               result.bytes / result.seconds / 1e6, result.rngCalls / result.bytes);
+    }
+
+    fflush(stdout);
+    if (perfCounters.anyAvailable()) {
+        printCounters(results, false);
+        printCounters(results, true);
+    } else {
+        fprintf(stderr, "\nHardware performance counters are unavailable here "
+                        "(no PMU access, or see /proc/sys/kernel/perf_event_paranoid).\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,723 @@
+/* License: GPL v2 */
+/* Contact author: wrochniak@gmail.com */
+
+#ifndef RANDODO_DAEMON_H
+#define RANDODO_DAEMON_H
+
+/* A local generation daemon and its client. The daemon loads a specification
+ * file once and serves requests over a Unix domain socket, so that many
+ * short-lived processes don't have to parse the same specs over and over.
+ *
+ * Wire format (host byte order, as both ends live on the same machine):
+ *   request:  RequestHeader, followed by nameLength bytes of generator name
+ *   response: a series of frames, each a FrameHeader followed by payloadLength
+ *             bytes. FRAME_BATCH carries `items` strings, each prefixed with
+ *             its uint32_t length. The response ends with FRAME_END, or with
+ *             FRAME_ERROR whose payload is an error message.
+ * Requests on one connection are answered in order; clients may pipeline. */
+
+#include "randodo.h"
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_set>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+namespace Randodo
+{
+
+namespace Daemon
+{
+
+struct RequestHeader
+{
+    uint32_t nameLength;
+    uint32_t count;
+    uint64_t seed;
+};
+
+enum FrameKind : uint32_t
+{
+    FRAME_BATCH = 1,
+    FRAME_END = 2,
+    FRAME_ERROR = 3,
+};
+
+struct FrameHeader
+{
+    uint32_t kind;
+    uint32_t items;
+    uint32_t payloadLength;
+};
+
+const uint32_t MAX_NAME_LENGTH = 4096;
+const size_t MAX_BATCH_PAYLOAD = 64 * 1024;
+// Long answers are generated in turns of about this size, so that other
+// clients get served in between.
+const size_t MAX_TURN_OUTPUT = 4 * MAX_BATCH_PAYLOAD;
+// An answer is put aside while its client has this much left to read.
+const size_t MAX_PENDING_OUTPUT = 4 * 1024 * 1024;
+
+/* The policy must be able to save and load its state (see
+ * SeededRandomNumberGenerator), as long answers get generated in turns,
+ * possibly by different workers. */
+template<typename RandNumGenerator = SeededRandomNumberGenerator>
+class Server
+{
+public:
+    Server(const std::string &specFileName, const std::string &socketPath,
+           unsigned workers = std::max(1U, std::thread::hardware_concurrency()))
+        : _specFileName(specFileName), _socketPath(socketPath), _workersCount(workers) {}
+
+    Server(const Server &) = delete;
+
+    ~Server()
+    {
+        for (auto &entry : _connections) {
+            ::close(entry.second->fd);
+        }
+        for (int fd : {_listenFd, _wakeFd, _epollFd}) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+        if (_listenFd >= 0) {
+            ::unlink(_socketPath.c_str());
+        }
+    }
+
+    // Loads the specs and binds the socket; run() may be called afterwards.
+    bool start(std::string &errMsg)
+    {
+        if (!loadConfig(errMsg)) {
+            return false;
+        }
+
+        sockaddr_un addr;
+        if (_socketPath.size() >= sizeof(addr.sun_path)) {
+            errMsg = "Socket path is too long";
+            return false;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, _socketPath.c_str());
+
+        _listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        _epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+        _wakeFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (_listenFd < 0 || _epollFd < 0 || _wakeFd < 0) {
+            errMsg = std::string("Couldn't create descriptors: ") + strerror(errno);
+            return false;
+        }
+
+        ::unlink(_socketPath.c_str());
+        if (::bind(_listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0
+                || ::listen(_listenFd, SOMAXCONN) < 0) {
+            errMsg = std::string("Couldn't listen on socket: ") + strerror(errno);
+            return false;
+        }
+
+        watch(_listenFd, EPOLLIN, LISTEN_ID);
+        watch(_wakeFd, EPOLLIN, WAKE_ID);
+        return true;
+    }
+
+    // Serves clients until stop() is called.
+    void run()
+    {
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < _workersCount; i++) {
+            workers.emplace_back([this]() { work(); });
+        }
+
+        epoll_event events[64];
+        while (!_stopped.load()) {
+            int ready = ::epoll_wait(_epollFd, events, 64, RELOAD_CHECK_INTERVAL_MS);
+            for (int i = 0; i < ready; i++) {
+                uint64_t id = events[i].data.u64;
+                if (id == LISTEN_ID) {
+                    acceptClients();
+                } else if (id == WAKE_ID) {
+                    handleWakeUps();
+                } else {
+                    handleClientEvent(id, events[i].events);
+                }
+            }
+            reloadConfigIfChanged();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_jobsMutex);
+            _jobs.clear();
+        }
+        _jobsCondition.notify_all();
+        for (auto &entry : _connections) {
+            markClosed(*entry.second);
+        }
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+
+    // Safe to call from other threads and from signal handlers.
+    void stop()
+    {
+        _stopped.store(true);
+        uint64_t one = 1;
+        ssize_t ignored = ::write(_wakeFd, &one, sizeof(one));
+        (void) ignored;
+    }
+
+private:
+    typedef ConfigFile<PlainFileReader, RandNumGenerator> Config;
+
+    static const uint64_t LISTEN_ID = 0;
+    static const uint64_t WAKE_ID = 1;
+    static const int RELOAD_CHECK_INTERVAL_MS = 1000;
+
+    struct Connection;
+
+    struct Job
+    {
+        std::shared_ptr<Connection> connection;
+        std::shared_ptr<Config> config;
+        std::string generatorName;
+        uint32_t left; // strings still to be generated
+        uint64_t seed;
+        Generator *generator = nullptr; // found in the first turn
+        std::string rngState; // between turns
+    };
+
+    struct Connection
+    {
+        int fd;
+        uint64_t id;
+        std::string inbox; // only touched by the event loop
+        bool busy = false; // a request is being answered; ditto
+        bool readClosed = false; // the client won't send more; ditto
+        bool outboxPending = false; // as of the last flush; ditto
+
+        std::mutex mutex; // guards everything below
+        std::deque<std::string> outbox;
+        size_t outboxBytes = 0;
+        size_t writeOffset = 0;
+        bool closed = false;
+        bool finishedRequest = false;
+        std::unique_ptr<Job> parkedJob; // waits for the outbox to drain
+    };
+
+    const std::string _specFileName, _socketPath;
+    const unsigned _workersCount;
+
+    int _listenFd = -1, _epollFd = -1, _wakeFd = -1;
+    std::atomic<bool> _stopped{false};
+    uint64_t _nextConnectionId = WAKE_ID + 1;
+    std::map<uint64_t, std::shared_ptr<Connection>> _connections;
+
+    std::mutex _configMutex;
+    std::shared_ptr<Config> _config;
+    timespec _configMTime = {0, 0};
+
+    std::mutex _jobsMutex;
+    std::condition_variable _jobsCondition;
+    std::deque<Job> _jobs;
+
+    std::mutex _wakeUpsMutex;
+    std::unordered_set<uint64_t> _wakeUps;
+
+    // Leaves the specs being served as they were if the file isn't valid.
+    bool loadConfig(std::string &errMsg)
+    {
+        struct stat st;
+        if (::stat(_specFileName.c_str(), &st) < 0) {
+            errMsg = "Couldn't read specification file " + _specFileName;
+            return false;
+        }
+        // Not retried until the file changes again.
+        _configMTime = st.st_mtim;
+
+        auto config = std::make_shared<Config>(_specFileName);
+        if (!config->isValid()) {
+            errMsg = "Invalid specification file " + _specFileName + ": " + config->getErrMsg();
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(_configMutex);
+        _config = std::move(config);
+        return true;
+    }
+
+    void reloadConfigIfChanged()
+    {
+        struct stat st;
+        if (::stat(_specFileName.c_str(), &st) < 0) {
+            return; // keep serving the old specs, the file may be being replaced
+        }
+        if (st.st_mtim.tv_sec != _configMTime.tv_sec || st.st_mtim.tv_nsec != _configMTime.tv_nsec) {
+            // Requests being answered keep their own reference to the old specs.
+            // A half-written file fails to parse, the next write reloads it.
+            std::string errMsg;
+            if (!loadConfig(errMsg)) {
+                std::cerr << errMsg << ", still serving the previous one" << std::endl;
+            }
+        }
+    }
+
+    void watch(int fd, uint32_t events, uint64_t id, int op = EPOLL_CTL_ADD)
+    {
+        epoll_event event;
+        event.events = events;
+        event.data.u64 = id;
+        ::epoll_ctl(_epollFd, op, fd, &event);
+    }
+
+    void acceptClients()
+    {
+        int fd;
+        while ((fd = ::accept4(_listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            auto connection = std::make_shared<Connection>();
+            connection->fd = fd;
+            connection->id = _nextConnectionId++;
+            _connections[connection->id] = connection;
+            watch(fd, EPOLLIN, connection->id);
+        }
+    }
+
+    void handleWakeUps()
+    {
+        uint64_t counter;
+        while (::read(_wakeFd, &counter, sizeof(counter)) > 0);
+
+        std::unordered_set<uint64_t> ids;
+        {
+            std::lock_guard<std::mutex> lock(_wakeUpsMutex);
+            ids.swap(_wakeUps);
+        }
+        for (uint64_t id : ids) {
+            handleClientEvent(id, EPOLLOUT);
+        }
+    }
+
+    void handleClientEvent(uint64_t id, uint32_t events)
+    {
+        auto it = _connections.find(id);
+        if (it == _connections.end()) {
+            return;
+        }
+        std::shared_ptr<Connection> connection = it->second;
+
+        bool ok = true;
+        if (!connection->readClosed && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            ok = readRequests(*connection);
+        }
+        if (ok) {
+            ok = flushOutbox(*connection);
+        }
+        if (ok) {
+            dispatchNextRequest(connection);
+        }
+        // After the client shut down its side, the requests it sent before
+        // still get answered.
+        if (!ok || (connection->readClosed && !connection->busy && !connection->outboxPending)) {
+            closeConnection(connection);
+        }
+    }
+
+    // Returns false on errors; the end of input only sets readClosed.
+    bool readRequests(Connection &connection)
+    {
+        char buffer[4096];
+        for (;;) {
+            ssize_t got = ::read(connection.fd, buffer, sizeof(buffer));
+            if (got > 0) {
+                connection.inbox.append(buffer, got);
+            } else if (got == 0) {
+                connection.readClosed = true;
+                return true;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            } else if (errno != EINTR) {
+                return false;
+            }
+        }
+    }
+
+    // Writes as much of the pending output as the socket accepts, and asks
+    // to be woken up when it accepts more.
+    bool flushOutbox(Connection &connection)
+    {
+        std::unique_lock<std::mutex> lock(connection.mutex);
+        while (!connection.outbox.empty()) {
+            const std::string &frame = connection.outbox.front();
+            ssize_t written = ::send(connection.fd, frame.data() + connection.writeOffset,
+                                     frame.size() - connection.writeOffset, MSG_NOSIGNAL);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    return false;
+                }
+                break;
+            }
+            connection.writeOffset += written;
+            if (connection.writeOffset == frame.size()) {
+                connection.outboxBytes -= frame.size();
+                connection.outbox.pop_front();
+                connection.writeOffset = 0;
+            }
+        }
+        std::unique_ptr<Job> resumed;
+        if (connection.parkedJob && connection.outboxBytes < MAX_PENDING_OUTPUT) {
+            resumed = std::move(connection.parkedJob);
+        }
+
+        if (connection.finishedRequest) {
+            connection.finishedRequest = false;
+            connection.busy = false;
+        }
+        bool pending = !connection.outbox.empty();
+        lock.unlock();
+
+        if (resumed) {
+            queueJob(std::move(*resumed));
+        }
+
+        // Readable forever once at EOF, so it's only watched until then.
+        connection.outboxPending = pending;
+        uint32_t events = 0;
+        if (!connection.readClosed) {
+            events |= EPOLLIN;
+        }
+        if (pending) {
+            events |= EPOLLOUT;
+        }
+        watch(connection.fd, events, connection.id, EPOLL_CTL_MOD);
+        return true;
+    }
+
+    void dispatchNextRequest(const std::shared_ptr<Connection> &connection)
+    {
+        if (connection->busy || connection->inbox.size() < sizeof(RequestHeader)) {
+            return;
+        }
+
+        RequestHeader header;
+        memcpy(&header, connection->inbox.data(), sizeof(header));
+        if (header.nameLength > MAX_NAME_LENGTH) {
+            closeConnection(connection);
+            return;
+        }
+        if (connection->inbox.size() < sizeof(header) + header.nameLength) {
+            return;
+        }
+
+        Job job;
+        job.connection = connection;
+        job.generatorName = connection->inbox.substr(sizeof(header), header.nameLength);
+        job.left = header.count;
+        job.seed = header.seed;
+        {
+            std::lock_guard<std::mutex> lock(_configMutex);
+            job.config = _config;
+        }
+        connection->inbox.erase(0, sizeof(header) + header.nameLength);
+        connection->busy = true;
+        queueJob(std::move(job));
+    }
+
+    void queueJob(Job &&job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_jobsMutex);
+            _jobs.push_back(std::move(job));
+        }
+        _jobsCondition.notify_one();
+    }
+
+    void markClosed(Connection &connection)
+    {
+        std::unique_ptr<Job> parkedJob; // it refers back to the connection
+        std::lock_guard<std::mutex> lock(connection.mutex);
+        connection.closed = true;
+        parkedJob.swap(connection.parkedJob);
+    }
+
+    void closeConnection(const std::shared_ptr<Connection> &connection)
+    {
+        markClosed(*connection);
+        ::epoll_ctl(_epollFd, EPOLL_CTL_DEL, connection->fd, nullptr);
+        ::close(connection->fd);
+        _connections.erase(connection->id);
+    }
+
+    void work()
+    {
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(_jobsMutex);
+                _jobsCondition.wait(lock, [this]() { return _stopped.load() || !_jobs.empty(); });
+                if (_stopped.load()) {
+                    return;
+                }
+                job = std::move(_jobs.front());
+                _jobs.pop_front();
+            }
+            answer(job);
+        }
+    }
+
+    // Generates one turn of the answer. An unfinished job goes back to the
+    // queue, or waits on its connection while the client lags behind with
+    // reading, so that slow clients never keep a worker busy.
+    void answer(Job &job)
+    {
+        Connection &connection = *job.connection;
+        if (!job.generator) {
+            auto &mapOfGenerators = job.config->getMapOfGenerators();
+            auto iter = mapOfGenerators.find(job.generatorName);
+            if (iter == mapOfGenerators.end()) {
+                sendFrame(connection, FRAME_ERROR, 0, "Couldn't find generator " + job.generatorName, true);
+                return;
+            }
+            job.generator = iter->second.get();
+            RandNumGenerator::seed(job.seed);
+        } else {
+            // Other jobs have used this thread's policy in the meantime.
+            std::istringstream state(job.rngState);
+            RandNumGenerator::loadState(state);
+        }
+
+        std::string payload, value;
+        size_t turnOutput = 0;
+        while (job.left > 0 && turnOutput < MAX_TURN_OUTPUT) {
+            payload.clear();
+            uint32_t items = 0;
+            while (job.left > 0 && payload.size() < MAX_BATCH_PAYLOAD) {
+                value.clear();
+                job.generator->generate(value);
+
+                uint32_t length = value.size();
+                payload.append(reinterpret_cast<const char *>(&length), sizeof(length));
+                payload += value;
+                items++;
+                job.left--;
+            }
+            turnOutput += payload.size();
+            if (!sendFrame(connection, FRAME_BATCH, items, payload, false)) {
+                return;
+            }
+        }
+
+        if (job.left == 0) {
+            sendFrame(connection, FRAME_END, 0, std::string(), true);
+            return;
+        }
+
+        std::ostringstream state;
+        RandNumGenerator::saveState(state);
+        job.rngState = state.str();
+        {
+            std::lock_guard<std::mutex> lock(connection.mutex);
+            if (connection.closed) {
+                return;
+            }
+            if (connection.outboxBytes >= MAX_PENDING_OUTPUT) {
+                // flushOutbox() queues it again.
+                connection.parkedJob.reset(new Job(std::move(job)));
+                return;
+            }
+        }
+        queueJob(std::move(job));
+    }
+
+    // Queues a frame for the event loop to write; returns false if the client is gone.
+    bool sendFrame(Connection &connection, FrameKind kind, uint32_t items, const std::string &payload, bool last)
+    {
+        FrameHeader header;
+        header.kind = kind;
+        header.items = items;
+        header.payloadLength = payload.size();
+
+        std::string frame(reinterpret_cast<const char *>(&header), sizeof(header));
+        frame += payload;
+
+        {
+            std::lock_guard<std::mutex> lock(connection.mutex);
+            if (connection.closed) {
+                return false;
+            }
+            connection.outboxBytes += frame.size();
+            connection.outbox.push_back(std::move(frame));
+            connection.finishedRequest = last;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_wakeUpsMutex);
+            _wakeUps.insert(connection.id);
+        }
+        uint64_t one = 1;
+        ssize_t ignored = ::write(_wakeFd, &one, sizeof(one));
+        (void) ignored;
+        return true;
+    }
+};
+
+class Client
+{
+public:
+    Client() {}
+
+    Client(const Client &) = delete;
+
+    ~Client()
+    {
+        if (_fd >= 0) {
+            ::close(_fd);
+        }
+    }
+
+    bool connect(const std::string &socketPath)
+    {
+        sockaddr_un addr;
+        if (socketPath.size() >= sizeof(addr.sun_path)) {
+            return false;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, socketPath.c_str());
+
+        _fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        return _fd >= 0 && ::connect(_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0;
+    }
+
+    // Calls consume for each of the count generated strings; the view is
+    // valid only during the call.
+    bool generate(const std::string &generatorName, uint32_t count, uint64_t seed,
+                  const std::function<void(std::string_view)> &consume, std::string &errMsg)
+    {
+        RequestHeader request;
+        request.nameLength = generatorName.size();
+        request.count = count;
+        request.seed = seed;
+
+        std::string message(reinterpret_cast<const char *>(&request), sizeof(request));
+        message += generatorName;
+        if (!writeAll(message)) {
+            errMsg = "Couldn't send request";
+            return false;
+        }
+
+        std::string payload;
+        for (;;) {
+            FrameHeader header;
+            if (!readAll(&header, sizeof(header))) {
+                errMsg = "Connection closed unexpectedly";
+                return false;
+            }
+            payload.resize(header.payloadLength);
+            if (!readAll(&payload[0], payload.size())) {
+                errMsg = "Connection closed unexpectedly";
+                return false;
+            }
+
+            switch (header.kind) {
+                case FRAME_BATCH:
+                    if (!unpackBatch(payload, header.items, consume)) {
+                        errMsg = "Malformed batch";
+                        return false;
+                    }
+                    break;
+                case FRAME_END:
+                    return true;
+                case FRAME_ERROR:
+                    errMsg = payload;
+                    return false;
+                default:
+                    errMsg = "Unexpected frame";
+                    return false;
+            }
+        }
+    }
+
+    bool generate(const std::string &generatorName, uint32_t count, uint64_t seed,
+                  std::vector<std::string> &results, std::string &errMsg)
+    {
+        return generate(generatorName, count, seed, [&results](std::string_view value) {
+            results.emplace_back(value);
+        }, errMsg);
+    }
+
+private:
+    int _fd = -1;
+
+    bool writeAll(const std::string &data)
+    {
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t written = ::send(_fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            done += written;
+        }
+        return true;
+    }
+
+    bool readAll(void *where, size_t size)
+    {
+        char *out = static_cast<char *>(where);
+        while (size > 0) {
+            ssize_t got = ::read(_fd, out, size);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return false;
+            }
+            out += got;
+            size -= got;
+        }
+        return true;
+    }
+
+    static bool unpackBatch(const std::string &payload, uint32_t items,
+                            const std::function<void(std::string_view)> &consume)
+    {
+        size_t offset = 0;
+        for (uint32_t i = 0; i < items; i++) {
+            uint32_t length;
+            if (payload.size() - offset < sizeof(length)) {
+                return false;
+            }
+            memcpy(&length, payload.data() + offset, sizeof(length));
+            offset += sizeof(length);
+            if (payload.size() - offset < length) {
+                return false;
+            }
+            consume(std::string_view(payload.data() + offset, length));
+            offset += length;
+        }
+        return offset == payload.size();
+    }
+};
+
+}
+
+}
+
+#endif
@@ -3,6 +3,14 @@
 
 #include "gtest/gtest.h"
 #include "randodo.h"
+#include "randodo_daemon.h"
+
+#include <filesystem>
+#include <future>
+#include <sys/resource.h>
+#if __cplusplus >= 202002L
+#include <ranges>
+#endif
 
 class FakeFileReader
 {
@@ -39,6 +47,8 @@ class FakeRandomNumberGenerator
 private:
     int _current = 0;
 public:
+    static void seed(uint64_t) {}
+
     int get()
     {
         return _current++;
@@ -56,6 +66,17 @@ TEST(ConfigFile, TestRegexConst)
     ASSERT_EQ("abcdef", stream.str());
 }
 
+TEST(ConfigFile, TestGenerateIntoStringstream)
+{
+    Randodo::ConstGenerator gen("x");
+    std::stringstream stream;
+
+    gen.generate(stream);
+    gen.generate(stream);
+
+    ASSERT_EQ("xx", stream.str());
+}
+
 TEST(ConfigFile, TestRegexTwoCharAlternatives)
 {
     std::string regex = "abc[def][ghi]";
@@ -85,6 +106,114 @@ TEST(ConfigFile, TestRegexTwoCharAlternativeRange)
 }
 
 
+TEST(ConfigFile, TestRegexUtf8CharAlternative)
+{
+    std::string regex = "[\u00e4-\u00e5\u0416\U0001F600]";
+    std::unique_ptr<Randodo::Generator> gen = Randodo::RegexParser<FakeFileReader, FakeRandomNumberGenerator>::parseExpression(regex);
+    std::stringstream str1, str2, str3, str4, str5;
+
+    gen->generate(str1);
+    gen->generate(str2);
+    gen->generate(str3);
+    gen->generate(str4);
+    gen->generate(str5);
+
+    ASSERT_EQ("\u00e4", str1.str());
+    ASSERT_EQ("\u00e5", str2.str());
+    ASSERT_EQ("\u0416", str3.str());
+    ASSERT_EQ("\U0001F600", str4.str());
+    ASSERT_EQ("\u00e4", str5.str());
+}
+
+TEST(ConfigFile, TestRegexUnicodeEscapes)
+{
+    std::string regex = "\\u{263a}[\\u{4e00}-\\u{9fff}]";
+    std::unique_ptr<Randodo::Generator> gen = Randodo::RegexParser<FakeFileReader, FakeRandomNumberGenerator>::parseExpression(regex);
+    std::stringstream str1, str2;
+
+    gen->generate(str1);
+    gen->generate(str2);
+
+    ASSERT_EQ("\u263a\u4e00", str1.str());
+    ASSERT_EQ("\u263a\u4e01", str2.str());
+}
+
+TEST(ConfigFile, TestRegexSkipsSurrogates)
+{
+    std::string regex = "\\u{d800}[\\u{d7ff}-\\u{e000}\xed\xa0\x80]";
+    std::unique_ptr<Randodo::Generator> gen = Randodo::RegexParser<FakeFileReader, FakeRandomNumberGenerator>::parseExpression(regex);
+    std::stringstream str1, str2, str3;
+
+    gen->generate(str1);
+    gen->generate(str2);
+    gen->generate(str3);
+
+    ASSERT_EQ("\ud7ff", str1.str());
+    ASSERT_EQ("\ue000", str2.str());
+    ASSERT_EQ("\ud7ff", str3.str());
+}
+
+TEST(ConfigFile, TestRegexTruncatedUtf8EndsWithCharAlternative)
+{
+    std::string regex = "[\xc3][ab]";
+    std::unique_ptr<Randodo::Generator> gen = Randodo::RegexParser<FakeFileReader, FakeRandomNumberGenerator>::parseExpression(regex);
+    std::stringstream str1, str2;
+
+    gen->generate(str1);
+    gen->generate(str2);
+
+    ASSERT_EQ("a", str1.str());
+    ASSERT_EQ("b", str2.str());
+}
+
+TEST(ConfigFile, TestRegexBackslashUWithoutBrace)
+{
+    std::string regex = "a\\ub[\\uv]\\u";
+    std::unique_ptr<Randodo::Generator> gen = Randodo::RegexParser<FakeFileReader, FakeRandomNumberGenerator>::parseExpression(regex);
+    std::stringstream str1, str2;
+
+    gen->generate(str1);
+    gen->generate(str2);
+
+    ASSERT_EQ("aubuu", str1.str());
+    ASSERT_EQ("aubvu", str2.str());
+}
+
+TEST(ConfigFile, TestRegexUnterminatedEscapes)
+{
+    for (std::string regex : {"x\\u{263a", "x\\u{", "x\\", "[x\\u{263a", "x\\u{110000}", "x\\u{}", "[x\\u{}]"}) {
+        std::unique_ptr<Randodo::Generator> gen = Randodo::RegexParser<FakeFileReader, FakeRandomNumberGenerator>::parseExpression(regex);
+        std::stringstream str;
+
+        gen->generate(str);
+
+        ASSERT_EQ("x", str.str()) << regex;
+
+        std::string errMsg;
+        Randodo::MapOfGenerators mapOfGenerators;
+        ASSERT_EQ(nullptr, (Randodo::RegexParser<FakeFileReader, FakeRandomNumberGenerator>::parseExpression(regex, mapOfGenerators, errMsg))) << regex;
+    }
+}
+
+TEST(ConfigFile, TestRegexRejectsOverlongUtf8)
+{
+    // NUL, slash and U+FFFF in needlessly long forms.
+    std::string regex = "[\xc0\x80\xe0\x80\xaf\xf0\x8f\xbf\xbf" "b]";
+    std::unique_ptr<Randodo::Generator> gen = Randodo::RegexParser<FakeFileReader, FakeRandomNumberGenerator>::parseExpression(regex);
+    std::stringstream str1, str2;
+
+    gen->generate(str1);
+    gen->generate(str2);
+
+    ASSERT_EQ("b", str1.str());
+    ASSERT_EQ("b", str2.str());
+
+    std::string errMsg;
+    Randodo::MapOfGenerators mapOfGenerators;
+    ASSERT_EQ(nullptr, (Randodo::RegexParser<FakeFileReader, FakeRandomNumberGenerator>::parseExpression(regex, mapOfGenerators, errMsg)));
+    ASSERT_EQ("Invalid UTF-8 in char alternative", errMsg);
+}
+
 TEST(ConfigFile, TestRegexOneConstAlternative)
 {
     std::string regex = "abc|def";
@@ -215,3 +344,714 @@ TEST(ConfigFile, TestVariable)
     ASSERT_EQ("dwarf g", str1.str());
     ASSERT_EQ("lilliput o", str2.str());
 }
+
+TEST(ConfigFile, TestReportsInvalidLine)
+{
+    FakeFileReader fakeFileReader;
+    fakeFileReader.addLine("first=abc");
+    fakeFileReader.addLine("second=(ab");
+    fakeFileReader.addLine("third=def");
+    Randodo::ConfigFile<FakeFileReader, FakeRandomNumberGenerator> configFile(fakeFileReader);
+
+    ASSERT_FALSE(configFile.isValid());
+    ASSERT_EQ("Line 2: Unmatched (", configFile.getErrMsg());
+    ASSERT_EQ(1U, configFile.getMapOfGenerators().size());
+}
+
+TEST(ConfigFile, TestRegexMalformedStillGenerates)
+{
+    for (std::string regex : {"(ab", "ab)", "a{x}", "{3}", "a{3,1}", "a{1,2,3}", "[ab", "$x", "((a|b"}) {
+        std::unique_ptr<Randodo::Generator> gen = Randodo::RegexParser<FakeFileReader, FakeRandomNumberGenerator>::parseExpression(regex);
+        std::string output;
+
+        gen->generate(output);
+    }
+
+    std::string errMsg;
+    Randodo::MapOfGenerators mapOfGenerators;
+    ASSERT_EQ(nullptr, (Randodo::RegexParser<FakeFileReader, FakeRandomNumberGenerator>::parseExpression("a{2", mapOfGenerators, errMsg)));
+    ASSERT_EQ("Unexpected char in repetitions spec", errMsg);
+}
+
+TEST(ConfigFile, TestRegexSeveralRepetitions)
+{
+    std::string regex = "x{2}y{3}";
+    std::unique_ptr<Randodo::Generator> gen = Randodo::RegexParser<FakeFileReader, FakeRandomNumberGenerator>::parseExpression(regex);
+    std::stringstream stream;
+
+    gen->generate(stream);
+
+    ASSERT_EQ("xxyyy", stream.str());
+}
+
+TEST(PrefetchQueue, TestPopsInGenerationOrder)
+{
+    std::string regex = "abc[de]";
+    std::unique_ptr<Randodo::Generator> gen = Randodo::RegexParser<FakeFileReader, FakeRandomNumberGenerator>::parseExpression(regex);
+    Randodo::PrefetchQueue<FakeRandomNumberGenerator> queue(*gen, 0, 4);
+
+    for (int i = 0; i < 100; i++) {
+        std::string_view value;
+        while (!queue.tryGet(value));
+        ASSERT_EQ(i % 2 ? "abce" : "abcd", value);
+    }
+
+    Randodo::PrefetchQueue<FakeRandomNumberGenerator>::Stats stats = queue.getStats();
+    ASSERT_EQ(100U, stats.consumed);
+    ASSERT_GE(stats.produced, 100U);
+    ASSERT_LE(stats.depth, 4U);
+
+    // Once the producer has filled the ring, the slot still being held
+    // doesn't count as queued.
+    for (stats = queue.getStats(); stats.produced < stats.consumed + 3; stats = queue.getStats()) {
+        std::this_thread::yield();
+    }
+    ASSERT_EQ(stats.produced - stats.consumed, stats.depth);
+    ASSERT_EQ(3U, stats.depth);
+}
+
+TEST(PrefetchQueue, TestQueuesFollowTheirSeeds)
+{
+    typedef Randodo::SeededRandomNumberGenerator SeededGenerator;
+    std::string regex = "[a-z]{8}";
+    std::unique_ptr<Randodo::Generator> gen1 = Randodo::RegexParser<FakeFileReader, SeededGenerator>::parseExpression(regex);
+    std::unique_ptr<Randodo::Generator> gen2 = Randodo::RegexParser<FakeFileReader, SeededGenerator>::parseExpression(regex);
+
+    std::vector<std::string> expected1(10), expected2(10), popped1, popped2;
+    SeededGenerator::seed(1);
+    for (auto &value : expected1) {
+        gen1->generate(value);
+    }
+    SeededGenerator::seed(2);
+    for (auto &value : expected2) {
+        gen2->generate(value);
+    }
+    ASSERT_NE(expected1, expected2);
+
+    // One generator per queue, as they run at the same time.
+    Randodo::PrefetchQueue<SeededGenerator> queue1(*gen1, 1, 4), queue2(*gen2, 2, 4);
+    for (int i = 0; i < 10; i++) {
+        std::string_view value;
+        while (!queue1.tryGet(value)) {
+            std::this_thread::yield();
+        }
+        popped1.emplace_back(value);
+        while (!queue2.tryGet(value)) {
+            std::this_thread::yield();
+        }
+        popped2.emplace_back(value);
+    }
+    ASSERT_EQ(expected1, popped1);
+    ASSERT_EQ(expected2, popped2);
+}
+
+TEST(PrefetchQueue, TestStatsDepthStaysWithinCapacity)
+{
+    std::string regex = "[a-z]{1,3}";
+    std::unique_ptr<Randodo::Generator> gen = Randodo::RegexParser<FakeFileReader, FakeRandomNumberGenerator>::parseExpression(regex);
+    Randodo::PrefetchQueue<FakeRandomNumberGenerator> queue(*gen, 0, 4);
+
+    // Sampled by another thread while the producer and the consumer race.
+    std::atomic<bool> done{false};
+    std::thread sampler([&]() {
+        while (!done.load()) {
+            ASSERT_LE(queue.getStats().depth, 4U);
+            std::this_thread::yield();
+        }
+    });
+    for (int i = 0; i < 2000; i++) {
+        std::string_view value;
+        while (!queue.tryGet(value)) {
+            std::this_thread::yield();
+        }
+    }
+    done = true;
+    sampler.join();
+}
+
+// A fresh directory for a test's files, removed with all of them even when
+// the test fails half-way.
+class TemporaryDirectory
+{
+public:
+    TemporaryDirectory()
+    {
+        std::string pattern = (std::filesystem::temp_directory_path() / "randodo_unittest.XXXXXX").string();
+        if (mkdtemp(&pattern[0])) {
+            _path = pattern;
+        }
+    }
+
+    TemporaryDirectory(const TemporaryDirectory &) = delete;
+
+    ~TemporaryDirectory()
+    {
+        if (!_path.empty()) {
+            std::filesystem::remove_all(_path);
+        }
+    }
+
+    std::string file(const std::string &name) const
+    {
+        return _path + "/" + name;
+    }
+
+private:
+    std::string _path;
+};
+
+// Runs a server until the end of the scope, including an early return of a
+// failed assertion.
+class ServerThread
+{
+public:
+    ServerThread(Randodo::Daemon::Server<> &server)
+        : _server(server), _thread([&server]() { server.run(); }) {}
+
+    ~ServerThread()
+    {
+        _server.stop();
+        _thread.join();
+    }
+
+private:
+    Randodo::Daemon::Server<> &_server;
+    std::thread _thread;
+};
+
+TEST(Daemon, TestServesSeededStrings)
+{
+    TemporaryDirectory directory;
+    std::string specFileName = directory.file("spec.txt"), socketPath = directory.file("daemon.sock");
+    {
+        std::ofstream spec(specFileName);
+        spec << "word=[a-z]{5,10}" << std::endl;
+    }
+
+    Randodo::Daemon::Server<> server(specFileName, socketPath, 2);
+    std::string errMsg;
+    ASSERT_TRUE(server.start(errMsg)) << errMsg;
+    ServerThread serverThread(server);
+
+    std::vector<std::string> expected;
+    {
+        Randodo::ConfigFile<Randodo::PlainFileReader, Randodo::SeededRandomNumberGenerator> configFile(specFileName);
+        Randodo::SeededRandomNumberGenerator::seed(42);
+        for (int i = 0; i < 10000; i++) {
+            expected.emplace_back();
+            configFile.getMapOfGenerators().find("word")->second->generate(expected.back());
+        }
+    }
+
+    Randodo::Daemon::Client client;
+    ASSERT_TRUE(client.connect(socketPath));
+
+    std::vector<std::string> results;
+    ASSERT_TRUE(client.generate("word", 10000, 42, results, errMsg)) << errMsg;
+    ASSERT_EQ(expected, results);
+
+    results.clear();
+    ASSERT_FALSE(client.generate("nonexistent", 1, 42, results, errMsg));
+    ASSERT_TRUE(results.empty());
+
+    ASSERT_TRUE(client.generate("word", 1, 42, results, errMsg)) << errMsg;
+    ASSERT_EQ(expected[0], results[0]);
+}
+
+TEST(Daemon, TestClientNotReadingDoesNotHoldUpOthers)
+{
+    TemporaryDirectory directory;
+    std::string specFileName = directory.file("spec.txt"), socketPath = directory.file("daemon.sock");
+    {
+        std::ofstream spec(specFileName);
+        spec << "word=[a-z]{5,10}" << std::endl;
+    }
+
+    // Declared before the server, so that if something hangs, closing the
+    // server's sockets on the way out still lets these finish.
+    Randodo::Daemon::Client slowClient, client;
+    std::future<bool> slowAnswered, answered;
+    std::promise<void> release, started;
+
+    Randodo::Daemon::Server<> server(specFileName, socketPath, 1);
+    std::string errMsg;
+    ASSERT_TRUE(server.start(errMsg)) << errMsg;
+    ServerThread serverThread(server);
+    ASSERT_TRUE(slowClient.connect(socketPath));
+    ASSERT_TRUE(client.connect(socketPath));
+
+    // Stops reading after the first string, until released; checks that
+    // answers generated in many turns still follow the seed.
+    const uint32_t slowCount = 1000000;
+    std::shared_future<void> released = release.get_future().share();
+    slowAnswered = std::async(std::launch::async, [&, released]() {
+        Randodo::ConfigFile<Randodo::PlainFileReader, Randodo::SeededRandomNumberGenerator> configFile(specFileName);
+        Randodo::Generator &gen = *configFile.getMapOfGenerators().find("word")->second;
+        Randodo::SeededRandomNumberGenerator::seed(7);
+        uint32_t matching = 0;
+        std::string slowErrMsg, expected;
+        bool ok = slowClient.generate("word", slowCount, 7, [&](std::string_view value) {
+            if (matching == 0) {
+                started.set_value();
+                released.wait();
+            }
+            expected.clear();
+            gen.generate(expected);
+            matching += value == expected;
+        }, slowErrMsg);
+        return ok && matching == slowCount;
+    });
+    ASSERT_EQ(std::future_status::ready, started.get_future().wait_for(std::chrono::seconds(10)));
+    // Enough for the only worker to fill the outbox of the slow client.
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    std::vector<std::string> results;
+    answered = std::async(std::launch::async, [&]() {
+        return client.generate("word", 1, 42, results, errMsg);
+    });
+    ASSERT_EQ(std::future_status::ready, answered.wait_for(std::chrono::seconds(10)));
+    ASSERT_TRUE(answered.get()) << errMsg;
+    ASSERT_EQ(1U, results.size());
+
+    release.set_value();
+    ASSERT_EQ(std::future_status::ready, slowAnswered.wait_for(std::chrono::seconds(30)));
+    ASSERT_TRUE(slowAnswered.get());
+}
+
+TEST(Daemon, TestAnswersRequestsSentBeforeShutdown)
+{
+    TemporaryDirectory directory;
+    std::string specFileName = directory.file("spec.txt"), socketPath = directory.file("daemon.sock");
+    {
+        std::ofstream spec(specFileName);
+        spec << "word=[a-z]{5,10}" << std::endl;
+    }
+
+    Randodo::Daemon::Server<> server(specFileName, socketPath, 2);
+    std::string errMsg;
+    ASSERT_TRUE(server.start(errMsg)) << errMsg;
+    ServerThread serverThread(server);
+
+    // Like nc -U: sends the requests, then shuts down its side at once.
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ASSERT_GE(fd, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketPath.c_str());
+    ASSERT_EQ(0, ::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)));
+    timeval timeout = {10, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    std::string requests;
+    for (uint32_t count : {3U, 100000U}) {
+        Randodo::Daemon::RequestHeader request = {4, count, 42};
+        requests.append(reinterpret_cast<const char *>(&request), sizeof(request));
+        requests += "word";
+    }
+    ASSERT_EQ(static_cast<ssize_t>(requests.size()), ::send(fd, requests.data(), requests.size(), MSG_NOSIGNAL));
+    ::shutdown(fd, SHUT_WR);
+
+    std::string response;
+    char buffer[65536];
+    ssize_t got;
+    while ((got = ::read(fd, buffer, sizeof(buffer))) > 0) {
+        response.append(buffer, got);
+    }
+    ::close(fd);
+    ASSERT_EQ(0, got); // closed by the server, not timed out
+
+    uint32_t items = 0, ends = 0;
+    for (size_t offset = 0; offset + sizeof(Randodo::Daemon::FrameHeader) <= response.size(); ) {
+        Randodo::Daemon::FrameHeader header;
+        memcpy(&header, response.data() + offset, sizeof(header));
+        offset += sizeof(header) + header.payloadLength;
+        items += header.kind == Randodo::Daemon::FRAME_BATCH ? header.items : 0;
+        ends += header.kind == Randodo::Daemon::FRAME_END;
+    }
+    ASSERT_EQ(100003U, items);
+    ASSERT_EQ(2U, ends);
+}
+
+TEST(Daemon, TestKeepsSpecsWhenReloadFails)
+{
+    TemporaryDirectory directory;
+    std::string specFileName = directory.file("spec.txt"), socketPath = directory.file("daemon.sock");
+    {
+        std::ofstream spec(specFileName);
+        spec << "word=abc" << std::endl;
+    }
+
+    Randodo::Daemon::Server<> server(specFileName, socketPath, 2);
+    std::string errMsg;
+    ASSERT_TRUE(server.start(errMsg)) << errMsg;
+    ServerThread serverThread(server);
+
+    Randodo::Daemon::Client client;
+    ASSERT_TRUE(client.connect(socketPath));
+
+    // Replaced at once, with the mtime moved on, so the server notices the
+    // change for sure and never sees the file truncated.
+    auto rewriteSpec = [&specFileName](const std::string &contents, int secondsLater) {
+        auto mtime = std::filesystem::last_write_time(specFileName);
+        std::string tmpName = specFileName + ".tmp";
+        std::ofstream(tmpName) << contents << std::endl;
+        std::filesystem::last_write_time(tmpName, mtime + std::chrono::seconds(secondsLater));
+        std::filesystem::rename(tmpName, specFileName);
+    };
+
+    // The server looks for changes after handling a request, so the second
+    // request after a rewrite is answered after the reload.
+    std::vector<std::string> results;
+    rewriteSpec("word=(ab", 1);
+    for (int i = 0; i < 2; i++) {
+        results.clear();
+        ASSERT_TRUE(client.generate("word", 1, 42, results, errMsg)) << errMsg;
+        ASSERT_EQ("abc", results[0]);
+    }
+
+    rewriteSpec("word=def", 2);
+    for (int i = 0; i < 2; i++) {
+        results.clear();
+        ASSERT_TRUE(client.generate("word", 1, 42, results, errMsg)) << errMsg;
+    }
+    ASSERT_EQ("def", results[0]);
+}
+
+TEST(RecordGenerator, TestCsvEscapingAndBindings)
+{
+    FakeFileReader fakeFileReader;
+    fakeFileReader.addLine("first=(Ann|Bob)");
+    fakeFileReader.addLine("name=$first");
+    fakeFileReader.addLine("email=$first@x.com");
+    fakeFileReader.addLine("note=(a,b|c\"d)");
+    Randodo::ConfigFile<FakeFileReader, FakeRandomNumberGenerator> configFile(fakeFileReader);
+
+    Randodo::RecordGenerator recordGenerator(configFile.getMapOfGenerators(), Randodo::CSV, true);
+    ASSERT_TRUE(recordGenerator.addColumn("name"));
+    ASSERT_TRUE(recordGenerator.addColumn("email"));
+    ASSERT_TRUE(recordGenerator.addColumn("note"));
+    ASSERT_FALSE(recordGenerator.addColumn("phone"));
+
+    std::string output;
+    recordGenerator.generateHeader(output);
+    recordGenerator.generate(output);
+    recordGenerator.generate(output);
+
+    ASSERT_EQ("name,email,note\n"
+              "Ann,Ann@x.com,\"a,b\"\n"
+              "Bob,Bob@x.com,\"c\"\"d\"\n", output);
+}
+
+TEST(RecordGenerator, TestJsonLinesWithoutBindings)
+{
+    FakeFileReader fakeFileReader;
+    fakeFileReader.addLine("first=(Ann|Bob)");
+    fakeFileReader.addLine("name=$first");
+    fakeFileReader.addLine("email=$first@x.com");
+    fakeFileReader.addLine("tab=a\tb\\\\");
+    Randodo::ConfigFile<FakeFileReader, FakeRandomNumberGenerator> configFile(fakeFileReader);
+
+    Randodo::RecordGenerator recordGenerator(configFile.getMapOfGenerators(), Randodo::JSON_LINES);
+    ASSERT_TRUE(recordGenerator.addColumn("name"));
+    ASSERT_TRUE(recordGenerator.addColumn("email"));
+    ASSERT_TRUE(recordGenerator.addColumn("tab"));
+
+    std::string output;
+    recordGenerator.generateHeader(output);
+    recordGenerator.generate(output);
+
+    ASSERT_EQ("{\"name\":\"Ann\",\"email\":\"Bob@x.com\",\"tab\":\"a\\tb\\\\\"}\n", output);
+}
+
+TEST(BatchGeneration, TestMatchesScalarForSequentialDraws)
+{
+    std::string regex = "abc(def|[ghi]{1,2})jkl";
+    std::unique_ptr<Randodo::Generator> gen = Randodo::RegexParser<FakeFileReader, FakeRandomNumberGenerator>::parseExpression(regex);
+    std::vector<std::string> outputs(4);
+
+    gen->generateBatch(outputs);
+
+    ASSERT_EQ("abcdefjkl", outputs[0]);
+    ASSERT_EQ("abcgjkl", outputs[1]);
+    ASSERT_EQ("abcdefjkl", outputs[2]);
+    ASSERT_EQ("abchijkl", outputs[3]);
+}
+
+TEST(BatchGeneration, TestAppendsToOutputs)
+{
+    FakeFileReader fakeFileReader;
+    fakeFileReader.addLine("gnome=(dwarf|lilliput)");
+    fakeFileReader.addLine("hobbit=$gnome{2}");
+    Randodo::ConfigFile<FakeFileReader, FakeRandomNumberGenerator> configFile(fakeFileReader);
+    std::vector<std::string> outputs = {"1:", "2:", "3:"};
+
+    configFile.getMapOfGenerators().find("hobbit")->second->generateBatch(outputs);
+
+    ASSERT_EQ("1:dwarflilliput", outputs[0]);
+    ASSERT_EQ("2:lilliputdwarf", outputs[1]);
+    ASSERT_EQ("3:dwarflilliput", outputs[2]);
+}
+
+class CountingRandomNumberGenerator
+{
+public:
+    static int calls;
+
+    static void seed(uint64_t value)
+    {
+        Randodo::SeededRandomNumberGenerator::seed(value);
+    }
+
+    int get()
+    {
+        calls++;
+        return _randNumGenerator.get();
+    }
+
+private:
+    Randodo::SeededRandomNumberGenerator _randNumGenerator;
+};
+
+int CountingRandomNumberGenerator::calls = 0;
+
+TEST(EntropyPooling, TestDrawsAreUniformAndShareEntropy)
+{
+    typedef Randodo::EntropyPoolingRandomNumberGenerator<CountingRandomNumberGenerator> PoolingGenerator;
+    PoolingGenerator::seed(7);
+    CountingRandomNumberGenerator::calls = 0;
+    PoolingGenerator generator;
+
+    const int draws = 260000;
+    std::vector<int> histogram(26);
+    for (int i = 0; i < draws; i++) {
+        uint32_t value = generator.getBounded(26);
+        ASSERT_LT(value, 26U);
+        histogram[value]++;
+    }
+
+    for (int count : histogram) {
+        ASSERT_NEAR(draws / 26, count, 500);
+    }
+    // log2(26) is about 4.7 bits, and every get() brings 31 of them.
+    ASSERT_LT(CountingRandomNumberGenerator::calls, draws / 6);
+}
+
+TEST(EntropyPooling, TestExtractsManyDrawsFromOneValue)
+{
+    // A single all-ones value from get() gives many draws of the top choice.
+    class AllOnesRandomNumberGenerator
+    {
+    public:
+        static void seed(uint64_t) {}
+        int get() { return 0x7fffffff; }
+    };
+    Randodo::EntropyPoolingRandomNumberGenerator<AllOnesRandomNumberGenerator> generator;
+
+    for (int i = 0; i < 100; i++) {
+        ASSERT_EQ(1U, generator.getBounded(2));
+    }
+}
+
+TEST(RandomNumberGeneratorState, TestRestoredStateRepeatsStrings)
+{
+    typedef Randodo::EntropyPoolingRandomNumberGenerator<Randodo::SeededRandomNumberGenerator> PoolingGenerator;
+    std::unique_ptr<Randodo::Generator> gen = Randodo::RegexParser<FakeFileReader, PoolingGenerator>::parseExpression("[a-z]{1,20}");
+    PoolingGenerator::seed(3);
+    for (int i = 0; i < 10; i++) {
+        std::string ignored;
+        gen->generate(ignored);
+    }
+
+    std::stringstream state;
+    PoolingGenerator::saveState(state);
+    std::string first, second;
+    gen->generate(first);
+
+    PoolingGenerator::seed(4);
+    ASSERT_TRUE(PoolingGenerator::loadState(state));
+    gen->generate(second);
+
+    ASSERT_EQ(first, second);
+
+    std::stringstream garbage("not a state");
+    ASSERT_FALSE(PoolingGenerator::loadState(garbage));
+}
+
+TEST(Optimize, TestConstantAlternativesAreCompacted)
+{
+    std::string words = "words=(";
+    for (int i = 0; i < 1000; i++) {
+        words += (i > 0 ? "|word" : "word") + std::to_string(i);
+    }
+    words += ")";
+
+    FakeFileReader plainReader, optimizedReader;
+    plainReader.addLine(words);
+    optimizedReader.addLine(words);
+    Randodo::ConfigFile<FakeFileReader, FakeRandomNumberGenerator> plain(plainReader, false), optimized(optimizedReader);
+    auto &plainGen = plain.getMapOfGenerators().find("words")->second;
+    auto &optimizedGen = optimized.getMapOfGenerators().find("words")->second;
+
+    ASSERT_LT(optimizedGen->memoryFootprint() * 4, plainGen->memoryFootprint());
+
+    std::string fromPlain, fromOptimized;
+    plainGen->generate(fromPlain);
+    optimizedGen->generate(fromOptimized);
+    ASSERT_EQ("word0", fromPlain);
+    ASSERT_EQ(fromPlain, fromOptimized);
+
+    std::vector<std::string> batch(3);
+    optimizedGen->generateBatch(batch);
+    ASSERT_EQ("word1", batch[0]);
+    ASSERT_EQ("word3", batch[2]);
+}
+
+TEST(Optimize, TestLongConstantAlternativesAreLeftAlone)
+{
+    rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+
+    FakeFileReader fakeFileReader;
+    fakeFileReader.addLine("big=(a{300000000}|b)");
+    Randodo::ConfigFile<FakeFileReader, FakeRandomNumberGenerator> configFile(fakeFileReader);
+    auto &gen = configFile.getMapOfGenerators().find("big")->second;
+
+    getrusage(RUSAGE_SELF, &after);
+    ASSERT_LT(after.ru_maxrss - before.ru_maxrss, 64 * 1024); // in kB
+    ASSERT_LT(gen->memoryFootprint(), 1024U);
+}
+
+// Written against the Generator interface as it was before footprints.
+class CustomGenerator : public Randodo::Generator
+{
+public:
+    void generate(std::string &output)
+    {
+        output += "custom";
+    }
+
+    bool isEmpty()
+    {
+        return false;
+    }
+
+    void optimize() {}
+};
+
+TEST(Optimize, TestCustomGeneratorsHaveDefaultFootprint)
+{
+    CustomGenerator gen;
+    std::string output;
+
+    gen.generate(output);
+
+    ASSERT_EQ("custom", output);
+    ASSERT_EQ(sizeof(Randodo::Generator), gen.memoryFootprint());
+}
+
+TEST(Stream, TestYieldsSeededStrings)
+{
+    typedef Randodo::SeededRandomNumberGenerator SeededGenerator;
+    std::unique_ptr<Randodo::Generator> gen = Randodo::RegexParser<FakeFileReader, SeededGenerator>::parseExpression("[a-z]{1,10}");
+
+    std::vector<std::string> expected(5);
+    SeededGenerator::seed(11);
+    for (auto &value : expected) {
+        gen->generate(value);
+    }
+
+    std::vector<std::string> streamed;
+    for (std::string_view value : Randodo::stream<SeededGenerator>(*gen, 5, 11)) {
+        streamed.emplace_back(value);
+    }
+    ASSERT_EQ(expected, streamed);
+
+    int count = 0;
+    for (std::string_view value : Randodo::stream<SeededGenerator>(*gen, 0, 11)) {
+        (void) value;
+        count++;
+    }
+    ASSERT_EQ(0, count);
+}
+
+TEST(Stream, TestConfigFileSeedsItsOwnPolicy)
+{
+    typedef Randodo::EntropyPoolingRandomNumberGenerator<Randodo::SeededRandomNumberGenerator> PoolingGenerator;
+    FakeFileReader fakeFileReader;
+    fakeFileReader.addLine("word=[a-z]{1,10}");
+    Randodo::ConfigFile<FakeFileReader, PoolingGenerator> configFile(fakeFileReader);
+    Randodo::Generator &gen = *configFile.getMapOfGenerators().find("word")->second;
+
+    std::vector<std::string> first, second, chunked;
+    for (std::string_view value : configFile.stream("word", 20, 11)) {
+        first.emplace_back(value);
+    }
+    // Leaves entropy in the pool, which seeding has to throw away.
+    std::string ignored;
+    gen.generate(ignored);
+    for (std::string_view value : configFile.stream("word", 20, 11)) {
+        second.emplace_back(value);
+    }
+    ASSERT_EQ(first, second);
+
+    gen.generate(ignored);
+    for (auto &chunk : configFile.streamChunks("word", 20, 11, 8)) {
+        chunked.insert(chunked.end(), chunk.begin(), chunk.end());
+    }
+    std::vector<std::string> expected(8);
+    PoolingGenerator::seed(11);
+    gen.generateBatch(expected);
+    ASSERT_EQ(20U, chunked.size());
+    ASSERT_EQ(expected, std::vector<std::string>(chunked.begin(), chunked.begin() + 8));
+
+    int count = 0;
+    for (std::string_view value : configFile.stream("nonexistent", 20, 11)) {
+        (void) value;
+        count++;
+    }
+    ASSERT_EQ(0, count);
+}
+
+// Ranges get moved around by view adaptors, e.g. into std::views::filter.
+typedef Randodo::GeneratedStrings<Randodo::SeededRandomNumberGenerator> SeededStrings;
+typedef Randodo::GeneratedChunks<Randodo::SeededRandomNumberGenerator> SeededChunks;
+static_assert(std::is_move_constructible<SeededStrings>::value && std::is_move_assignable<SeededStrings>::value, "");
+static_assert(std::is_move_constructible<SeededChunks>::value && std::is_move_assignable<SeededChunks>::value, "");
+
+#if __cplusplus >= 202002L
+TEST(Stream, TestWorksWithRangeAdaptors)
+{
+    typedef Randodo::SeededRandomNumberGenerator SeededGenerator;
+    std::unique_ptr<Randodo::Generator> gen = Randodo::RegexParser<FakeFileReader, SeededGenerator>::parseExpression("[ab]{3}");
+
+    int count = 0;
+    for (std::string_view value : Randodo::stream<SeededGenerator>(*gen, 100, 11)
+                                  | std::views::filter([](std::string_view s) { return s[0] == 'a'; })) {
+        ASSERT_EQ('a', value[0]);
+        count++;
+    }
+    ASSERT_GT(count, 0);
+    ASSERT_LT(count, 100);
+}
+#endif
+
+TEST(Stream, TestYieldsChunksOfBatches)
+{
+    typedef Randodo::SeededRandomNumberGenerator SeededGenerator;
+    std::unique_ptr<Randodo::Generator> gen = Randodo::RegexParser<FakeFileReader, SeededGenerator>::parseExpression("[a-z]{1,10}");
+
+    std::vector<std::string> expected(4);
+    SeededGenerator::seed(11);
+    gen->generateBatch(expected);
+
+    std::vector<size_t> sizes;
+    std::vector<std::string> streamed;
+    for (auto &chunk : Randodo::streamChunks<SeededGenerator>(*gen, 10, 11, 4)) {
+        sizes.push_back(chunk.size());
+        streamed.insert(streamed.end(), chunk.begin(), chunk.end());
+    }
+    ASSERT_EQ(std::vector<size_t>({4, 4, 2}), sizes);
+    ASSERT_EQ(10U, streamed.size());
+    ASSERT_EQ(expected, std::vector<std::string>(streamed.begin(), streamed.begin() + 4));
+}